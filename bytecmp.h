@@ -0,0 +1,195 @@
+//Module name: bytecmp
+//Author: Alcaro
+//Date: See Git history
+//Licence: GPL v3.0 or higher
+
+//Usable from both C and C++.
+
+#ifndef BYTECMP_H
+#define BYTECMP_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BYTECMP_SSE2
+#endif
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BYTECMP_WORD
+#endif
+
+//Returns how many bytes at the start of 'a' and 'b' are equal, at most 'len'. Reads nothing past 'len'.
+//Same as the obvious one-byte loop, but much faster on long matches.
+static inline size_t bytecmp_len(const uint8_t* a, const uint8_t* b, size_t len)
+{
+	size_t i = 0;
+
+#ifdef BYTECMP_SSE2
+	while (i+16 <= len)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i*)(a+i));
+		__m128i y = _mm_loadu_si128((const __m128i*)(b+i));
+		unsigned mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xFFFF;
+		if (mask)
+		{
+#if defined(__GNUC__)
+			return i + __builtin_ctz(mask);
+#else
+			while (!(mask&1)) { mask >>= 1; i++; }
+			return i;
+#endif
+		}
+		i += 16;
+	}
+#endif
+
+#ifdef BYTECMP_WORD
+	//on little endian, the lowest set bit of x^y is in the first differing byte
+	while (i+sizeof(uint64_t) <= len)
+	{
+		uint64_t x;
+		uint64_t y;
+		memcpy(&x, a+i, sizeof(x)); // memcpy is the only legal unaligned load, and compilers know that
+		memcpy(&y, b+i, sizeof(y));
+		if (x != y) return i + (__builtin_ctzll(x^y) >> 3);
+		i += sizeof(uint64_t);
+	}
+#endif
+
+	while (i<len && a[i]==b[i]) i++;
+	return i;
+}
+
+//Returns how many bytes at the start of 'a' and 'b' are all different, at most 'len'. Reads nothing past
+// 'len'. The opposite of bytecmp_len.
+static inline size_t bytecmp_difflen(const uint8_t* a, const uint8_t* b, size_t len)
+{
+	size_t i = 0;
+
+#ifdef BYTECMP_SSE2
+	while (i+16 <= len)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i*)(a+i));
+		__m128i y = _mm_loadu_si128((const __m128i*)(b+i));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+		if (mask)
+		{
+#if defined(__GNUC__)
+			return i + __builtin_ctz(mask);
+#else
+			while (!(mask&1)) { mask >>= 1; i++; }
+			return i;
+#endif
+		}
+		i += 16;
+	}
+#endif
+
+#ifdef BYTECMP_WORD
+	//same zero byte check as bytecmp_skip3
+	const uint64_t low7 = 0x7F7F7F7F7F7F7F7FULL;
+	while (i+sizeof(uint64_t) <= len)
+	{
+		uint64_t x;
+		uint64_t y;
+		memcpy(&x, a+i, sizeof(x));
+		memcpy(&y, b+i, sizeof(y));
+		uint64_t diff = x^y;
+		uint64_t zero = ~(((diff & low7) + low7) | diff | low7);
+		if (zero) return i + (__builtin_ctzll(zero) >> 3);
+		i += sizeof(uint64_t);
+	}
+#endif
+
+	while (i<len && a[i]!=b[i]) i++;
+	return i;
+}
+
+//Returns how many positions at the start of 'a' and 'b' are known to not start three equal bytes in a
+// row (a[i..i+2] == b[i..i+2]). Not every position is checked; the caller must continue byte by byte
+// from the returned one, which may or may not be such a run. Reads nothing past 'len'.
+static inline size_t bytecmp_skip3(const uint8_t* a, const uint8_t* b, size_t len)
+{
+	size_t i = 0;
+
+#ifdef BYTECMP_SSE2
+	if (len >= 32)
+	{
+		//a run can cross into the next 16 bytes, so keep that one's mask around
+		unsigned cur = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)b)));
+		while (i+32 <= len)
+		{
+			__m128i x = _mm_loadu_si128((const __m128i*)(a+i+16));
+			__m128i y = _mm_loadu_si128((const __m128i*)(b+i+16));
+			unsigned next = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+			unsigned both = cur | (next<<16);
+			unsigned run = both & (both>>1) & (both>>2) & 0xFFFF;
+			if (run)
+			{
+#if defined(__GNUC__)
+				return i + __builtin_ctz(run);
+#else
+				while (!(run&1)) { run >>= 1; i++; }
+				return i;
+#endif
+			}
+			cur = next;
+			i += 16;
+		}
+	}
+#elif defined(BYTECMP_WORD)
+	//the high bit of each byte of 'zero' is set if that byte is equal; the top two bytes can't be
+	// checked for runs, so it moves 6 at the time
+	const uint64_t low7 = 0x7F7F7F7F7F7F7F7FULL;
+	while (i+sizeof(uint64_t) <= len)
+	{
+		uint64_t x;
+		uint64_t y;
+		memcpy(&x, a+i, sizeof(x));
+		memcpy(&y, b+i, sizeof(y));
+		uint64_t diff = x^y;
+		uint64_t zero = ~(((diff & low7) + low7) | diff | low7);
+		uint64_t run = zero & (zero>>8) & (zero>>16) & 0x0000808080808080ULL;
+		if (run) return i + (__builtin_ctzll(run) >> 3);
+		i += 6;
+	}
+#endif
+
+	return i;
+}
+
+//Fills out[start, end) from in[start, end), and with zeroes past 'inlen'; nothing at or past 'outlen'
+// is written. It's how the IPS and UPS appliers fill the gaps between the patched parts.
+static inline void bytecmp_copy_input(uint8_t* out, const uint8_t* in, size_t inlen, size_t outlen, size_t start, size_t end)
+{
+	if (end > outlen) end = outlen;
+	if (start >= end) return;
+	size_t copyend = (end < inlen ? end : inlen);
+	if (start < copyend)
+	{
+		memcpy(out+start, in+start, copyend-start);
+		start = copyend;
+	}
+	if (start < end) memset(out+start, 0, end-start);
+}
+
+//Returns the first position where 'run' bytes in a row of 'a' and 'b' are equal, or 'len' if there is
+// no such position. 'run' must be at least 3. Reads nothing past 'len'.
+static inline size_t bytecmp_find_run(const uint8_t* a, const uint8_t* b, size_t len, size_t run)
+{
+	size_t i = 0;
+	while (i+run <= len)
+	{
+		i += bytecmp_skip3(a+i, b+i, len-i);
+		if (i+run > len) break;
+		size_t same = bytecmp_len(a+i, b+i, run);
+		if (same == run) return i;
+		i += same+1;
+	}
+	return len;
+}
+
+#endif
@@ -9,13 +9,71 @@ static const uint32_t crctable_4bits[]={
 	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
 	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
 };
+//Four bits at the time is slow on anything big, so the bytes are done eight at the time, with one table
+// per byte position. table[k][n] is the CRC of byte n followed by k zero bytes, without the inversions.
+//They're built from the small table above before main(), so no thread can see them half done.
+static struct crc32_tables {
+	uint32_t table[8][256];
+	crc32_tables()
+	{
+		for (int n=0;n<256;n++)
+		{
+			uint32_t crc = n;
+			crc = crctable_4bits[crc&0x0F] ^ (crc>>4);
+			crc = crctable_4bits[crc&0x0F] ^ (crc>>4);
+			table[0][n] = crc;
+		}
+		for (int k=1;k<8;k++)
+		for (int n=0;n<256;n++)
+		{
+			table[k][n] = (table[k-1][n]>>8) ^ table[0][table[k-1][n]&0xFF];
+		}
+	}
+} crc32_tables;
+
 uint32_t crc32_update(const uint8_t* data, size_t len, uint32_t crc)
 {
+	const uint32_t (*table)[256] = crc32_tables.table;
 	crc = ~crc;
-	for (size_t i=0;i<len;i++)
+	size_t i=0;
+	for (;i+8<=len;i+=8)
+	{
+		const uint8_t* p = data+i;
+		uint32_t lo = crc ^ (p[0] | p[1]<<8 | p[2]<<16 | (uint32_t)p[3]<<24);
+		crc = table[7][lo&0xFF] ^ table[6][(lo>>8)&0xFF] ^ table[5][(lo>>16)&0xFF] ^ table[4][lo>>24] ^
+		      table[3][p[4]] ^ table[2][p[5]] ^ table[1][p[6]] ^ table[0][p[7]];
+	}
+	for (;i<len;i++)
 	{
-		crc = crctable_4bits[(crc^ data[i]    )&0x0F] ^ (crc>>4);
-		crc = crctable_4bits[(crc^(data[i]>>4))&0x0F] ^ (crc>>4);
+		crc = table[0][(crc^data[i])&0xFF] ^ (crc>>8);
 	}
 	return ~crc;
 }
+
+//a*b modulo the CRC polynomial, in the same bit-reversed order as the CRC itself
+static uint32_t crc32_multiply(uint32_t a, uint32_t b)
+{
+	uint32_t ret = 0;
+	for (int i=0;i<32;i++)
+	{
+		if (a & 0x80000000) ret ^= b;
+		a <<= 1;
+		b = (b>>1) ^ (b&1 ? 0xEDB88320 : 0);
+	}
+	return ret;
+}
+
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+	//appending len2 zero bytes to the first part multiplies its CRC by x^(8*len2); the second part's CRC
+	// then adds on top of that
+	uint32_t power = 0x00800000; // x^8
+	uint32_t factor = 0x80000000; // 1
+	while (len2)
+	{
+		if (len2 & 1) factor = crc32_multiply(factor, power);
+		power = crc32_multiply(power, power);
+		len2 >>= 1;
+	}
+	return crc32_multiply(factor, crc1) ^ crc2;
+}
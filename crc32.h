@@ -7,4 +7,6 @@
 #include <stdlib.h>
 
 uint32_t crc32_update(const uint8_t* data, size_t len, uint32_t crc);
+//Returns the CRC of A followed by B, given crc32(A), crc32(B) and the length of B.
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2);
 static inline uint32_t crc32(const uint8_t* data, size_t len) { return crc32_update(data, len, 0); }
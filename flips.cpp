@@ -5,6 +5,14 @@
 
 #include "flips.h"
 #include "crc32.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifndef FLIPS_WINDOWS
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
 
 #ifdef __MINGW32__
 //get rid of dependencies on libstdc++, they waste 200KB on this platform
@@ -73,6 +81,65 @@ void FreeFileMemory(struct mem mem)
 	free(mem.ptr);
 }
 
+static void RemoveFile(LPCWSTR filename)
+{
+#ifdef FLIPS_WINDOWS
+	_wremove(filename);
+#else
+	remove(filename);
+#endif
+}
+
+//Creates an empty file beside 'filename', with a name nothing else had, and returns that name (free it), or
+// NULL. It's created exclusively, so it can't be a file the user already has, or another thread's.
+static LPWSTR CreateTempFile(LPCWSTR filename)
+{
+	size_t len=wcslen(filename);
+	LPWSTR ret=(LPWSTR)malloc(sizeof(WCHAR)*(len+16));
+	for (int i=0;i<1000;i++)
+	{
+		wcscpy(ret, filename);
+		if (i==0) wcscat(ret, TEXT(".tmp"));
+		else swprintf(ret+len, 16, TEXT(".%i.tmp"), i);
+#ifdef FLIPS_WINDOWS
+		HANDLE h=CreateFile(ret, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (h!=INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(h);
+			return ret;
+		}
+		if (GetLastError()!=ERROR_FILE_EXISTS) break;
+#else
+		int fd=open(ret, O_WRONLY|O_CREAT|O_EXCL, 0666);
+		if (fd>=0)
+		{
+			close(fd);
+			return ret;
+		}
+		if (errno!=EEXIST) break;
+#endif
+	}
+	free(ret);
+	return NULL;
+}
+
+//Moves 'from' over 'to', replacing anything that's there. If the platform can't (for example if they're
+// not on the same file system), it's copied instead.
+static bool MoveFileOver(LPCWSTR from, LPCWSTR to)
+{
+#ifdef FLIPS_WINDOWS
+	if (MoveFileEx(from, to, MOVEFILE_REPLACE_EXISTING)) return true;
+#else
+	if (rename(from, to)==0) return true;
+#endif
+	struct mem data=file::read(from);
+	if (!data.ptr) return false;
+	bool ret=filewrite::write(to, data);
+	free(data.ptr);
+	if (ret) RemoveFile(from);
+	return ret;
+}
+
 
 
 
@@ -171,6 +238,50 @@ filemap* filemap::create_fallback(LPCWSTR filename)
 	return filemap_fallback::create(file::create(filename));
 }
 
+#if !defined(FLIPS_WINDOWS) && (defined(__unix__) || defined(__APPLE__))
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+class filemap_mmap : public filemap {
+public:
+	size_t m_len;
+	uint8_t* m_ptr;
+	
+	static filemap* create(const char * filename)
+	{
+		int fd = open(filename, O_RDONLY);
+		if (fd < 0) return NULL;
+		
+		struct stat st;
+		if (fstat(fd, &st) < 0 || st.st_size <= 0 || (off_t)(size_t)st.st_size != st.st_size)
+		{
+			close(fd);
+			return NULL;
+		}
+		void* ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (ptr == MAP_FAILED) return NULL;
+		return new filemap_mmap((uint8_t*)ptr, st.st_size);
+	}
+	
+	size_t len() { return m_len; }
+	const uint8_t * ptr() { return m_ptr; }
+	
+	filemap_mmap(uint8_t* ptr, size_t len) : m_len(len), m_ptr(ptr) {}
+	~filemap_mmap() { munmap(m_ptr, m_len); }
+};
+filemap* filemap::create_mmap(LPCWSTR filename)
+{
+	filemap* ret = filemap_mmap::create(filename);
+	if (!ret) ret = filemap::create(filename);
+	return ret;
+}
+#else
+filemap* filemap::create_mmap(LPCWSTR filename) { return filemap::create(filename); }
+#endif
+
 
 
 
@@ -200,6 +311,12 @@ LPWSTR GetBaseName(LPCWSTR fname)
 }
 
 bool forceKeepHeader=false;
+struct mem sourceIndex={NULL,0}; // if set, used for all BPS delta patches
+size_t hashTableSize=0; // for --bps-hash; 0 is automatic
+size_t patchMemory=0; // if nonzero, BPS creation picks a method that fits in this many bytes
+bps_delta_ctx** deltaContexts=NULL; // if set, one per thread, used for all BPS delta patches
+bool showProgress=true;
+bool printStats=false; // --stats; only the command line sets this
 
 #ifndef FLIPS_CLI
 bool guiActive=false;
@@ -266,6 +383,39 @@ public:
 	~fileheadermap() { delete child; }
 };
 
+//A ROM that's already in memory, with its checksum known. --create-many keeps the clean ROM like this, so
+// it's read and checksummed once, not once per patch.
+struct loadedrom {
+	struct mem data; // without the header, if it should be removed
+	uint32_t crc;
+};
+
+class fileloaded : public file {
+	const struct loadedrom * rom;
+
+public:
+	fileloaded(const struct loadedrom * rom) : rom(rom) {}
+	
+	size_t len() { return rom->data.len; }
+	bool read(uint8_t* target, size_t start, size_t len)
+	{
+		if (start > rom->data.len || len > rom->data.len-start) return false;
+		memcpy(target, rom->data.ptr+start, len);
+		return true;
+	}
+	bool known_crc32(uint32_t* crc) { *crc = rom->crc; return true; }
+};
+
+class filemaploaded : public filemap {
+	const struct loadedrom * rom;
+
+public:
+	filemaploaded(const struct loadedrom * rom) : rom(rom) {}
+	
+	size_t len() { return rom->data.len; }
+	const uint8_t* ptr() { return rom->data.ptr; }
+};
+
 
 
 
@@ -278,6 +428,7 @@ const struct errorinfo ipserrors[]={
 		
 		{ el_broken, "The IPS format does not support files larger than 16MB." },//ips_16MB
 		{ el_warning, "The files are identical! The patch will do nothing." },//ips_identical
+		{ el_broken, "Couldn't write patch." },//ips_write_failed
 	};
 
 const struct errorinfo bpserrors[]={
@@ -291,6 +442,8 @@ const struct errorinfo bpserrors[]={
 		{ el_broken, "These files are too big for this program to handle." },//bps_too_big
 		{ el_broken, "These files are too big for this program to handle." },//bps_out_of_mem (same message as above, it's accurate for both.)
 		{ el_broken, "Patch creation was canceled." },//bps_canceled
+		{ el_broken, "The source index is damaged, or doesn't belong to this ROM." },//bps_wrong_index
+		{ el_broken, "Couldn't write patch." },//bps_write_failed
 	};
 
 LPCWSTR GetManifestName(LPCWSTR romname)
@@ -777,6 +930,40 @@ static struct errorinfo error(errorlevel level, const char * text)
 	return errinf;
 }
 
+//the counts are printed as doubles, since there's no size_t format that works everywhere
+static void PrintPhase(const char * name, struct phase_time time)
+{
+	if (time.wall==0 && time.cpu==0) return;
+	printf("  %-7s %9.3fs wall %9.3fs cpu\n", name, time.wall, time.cpu);
+}
+
+static void PrintBpsStats(LPCWSTR filename, const struct bps_stats * stats)
+{
+	wprintf(TEXT("%s: time spent:\n"), filename);
+	PrintPhase("alloc", stats->alloc);
+	PrintPhase("read", stats->read);
+	PrintPhase("sort", stats->sort);
+	PrintPhase("index", stats->index);
+	PrintPhase("search", stats->search);
+	PrintPhase("emit", stats->emit);
+	PrintPhase("crc", stats->crc);
+	PrintPhase("apply", stats->apply);
+	static const char * const names[4]={ "SourceRead", "TargetRead", "SourceCopy", "TargetCopy" };
+	for (int i=0;i<4;i++)
+	{
+		printf("  %-10s %10.0f commands %12.0f bytes\n", names[i], (double)stats->cmd_count[i], (double)stats->cmd_bytes[i]);
+	}
+}
+
+static void PrintIpsStats(LPCWSTR filename, const struct ips_stats * stats)
+{
+	wprintf(TEXT("%s: time spent:\n"), filename);
+	PrintPhase("study", stats->study);
+	PrintPhase("apply", stats->apply);
+	printf("  %-10s %10.0f records  %12.0f bytes\n", "plain", (double)stats->records, (double)stats->record_bytes);
+	printf("  %-10s %10.0f records  %12.0f bytes\n", "RLE", (double)stats->rle_records, (double)stats->rle_bytes);
+}
+
 struct errorinfo ApplyPatchMem2(file* patch, struct mem inrom, bool verifyinput, bool removeheader,
                                 LPCWSTR outromname, struct manifestinfo * manifestinfo)
 {
@@ -796,7 +983,10 @@ struct errorinfo ApplyPatchMem2(file* patch, struct mem inrom, bool verifyinput,
 	errinf=error(el_broken, "Unknown patch format.");
 	if (patchtype==ty_bps)
 	{
-		errinf=bpserrors[bps_apply(patchmem, inrom, &outrom, &manifest, !verifyinput)];
+		struct bps_stats stats;
+		memset(&stats, 0, sizeof(stats));
+		errinf=bpserrors[bps_apply_stats(patchmem, inrom, &outrom, &manifest, !verifyinput, printStats ? &stats : NULL)];
+		if (printStats) PrintBpsStats(outromname, &stats);
 		if (errinf.level==el_notthis && !verifyinput && outrom.ptr)
 			errinf = error(el_warning, "This patch is not intended for this ROM (output created anyways)");
 		if (errinf.level==el_notthis)
@@ -839,7 +1029,13 @@ struct errorinfo ApplyPatchMem2(file* patch, struct mem inrom, bool verifyinput,
 			}
 		}
 	}
-	if (patchtype==ty_ips) errinf=ipserrors[ips_apply(patchmem, inrom, &outrom)];
+	if (patchtype==ty_ips)
+	{
+		struct ips_stats stats;
+		memset(&stats, 0, sizeof(stats));
+		errinf=ipserrors[ips_apply_stats(patchmem, inrom, &outrom, printStats ? &stats : NULL)];
+		if (printStats) PrintIpsStats(outromname, &stats);
+	}
 	if (patchtype==ty_ups) errinf=bpserrors[ups_apply(patchmem, inrom, &outrom)];
 	if (errinf.level==el_ok) errinf.description="The patch was applied successfully!";
 	
@@ -921,6 +1117,46 @@ struct errorinfo ApplyPatchMem(file* patch, LPCWSTR inromname, bool verifyinput,
 	return errinf;
 }
 
+//UPS patches can be applied a window at the time, so the ROM doesn't need to fit in memory.
+static struct errorinfo ApplyUpsStream(file* patch, LPCWSTR inromname, bool verifyinput,
+                                       LPCWSTR outromname, struct manifestinfo * manifestinfo, bool update_rom_list)
+{
+	//the output is written while the input is still being read, so this can't replace anything; the
+	// output could be the input under another name
+	if (file::exists(outromname))
+	{
+		return ApplyPatchMem(patch, inromname, verifyinput, outromname, manifestinfo, update_rom_list);
+	}
+	
+	file* inrom = file::create(inromname);
+	if (!inrom)
+	{
+		if (update_rom_list) DeleteRomFromList(inromname);
+		return error(el_broken, "Couldn't read ROM");
+	}
+	filewrite* outrom = filewrite::create(outromname);
+	if (!outrom)
+	{
+		delete inrom;
+		return error(el_broken, "Couldn't write ROM");
+	}
+	struct errorinfo errinf=bpserrors[ups_apply_file(patch, inrom, outrom)];
+	delete outrom;
+	delete inrom;
+	if (errinf.level==el_ok) errinf.description="The patch was applied successfully!";
+	
+	//same as ApplyPatchMem2; UPS has no manifests
+	if (manifestinfo && manifestinfo->use && manifestinfo->required && errinf.level==el_ok)
+	{
+		errinf=error(el_warning, "The patch was applied, but there was no manifest present.");
+	}
+	
+	//the output was written before the checksums were known, so it must go if they didn't match
+	if (errinf.level>=el_notthis) RemoveFile(outromname);
+	if (update_rom_list && errinf.level==el_ok) AddToRomList(patch, inromname);
+	return errinf;
+}
+
 struct errorinfo ApplyPatch(LPCWSTR patchname, LPCWSTR inromname, bool verifyinput,
                             LPCWSTR outromname, struct manifestinfo * manifestinfo, bool update_rom_list)
 {
@@ -929,7 +1165,11 @@ struct errorinfo ApplyPatch(LPCWSTR patchname, LPCWSTR inromname, bool verifyinp
 	{
 		return error(el_broken, "Couldn't read input patch");
 	}
-	struct errorinfo errinf=ApplyPatchMem(patch, inromname, verifyinput, outromname, manifestinfo, update_rom_list);
+	struct errorinfo errinf;
+	if (IdentifyPatch(patch)==ty_ups)
+		errinf=ApplyUpsStream(patch, inromname, verifyinput, outromname, manifestinfo, update_rom_list);
+	else
+		errinf=ApplyPatchMem(patch, inromname, verifyinput, outromname, manifestinfo, update_rom_list);
 	delete patch;
 	return errinf;
 }
@@ -965,10 +1205,101 @@ bool bpsdeltaProgressCLI(void* userdata, size_t done, size_t total)
 	return true;
 }
 
-struct errorinfo CreatePatchToMem(LPCWSTR inromname, LPCWSTR outromname, enum patchtype patchtype,
-                                  struct manifestinfo * manifestinfo, struct mem * patchmem)
+static LPCWSTR PatchTypeName(enum patchtype patchtype)
+{
+	switch (patchtype)
+	{
+		case ty_bps: return TEXT("--bps-delta");
+		case ty_bps_moremem: return TEXT("--bps-delta-moremem");
+		case ty_bps_optimal: return TEXT("--bps-optimal");
+		case ty_bps_hash: return TEXT("--bps-hash");
+		case ty_bps_linear: return TEXT("--bps-linear");
+		case ty_ips: return TEXT("--ips");
+		case ty_ups: return TEXT("--ups");
+		default: return TEXT("(unknown)");
+	}
+}
+
+//Returns the patch type, at most as good as the given one, that gives the smallest BPS patches
+// without using more than 'budget' bytes, or ty_null if nothing fits. Other formats are returned as is.
+//The hash table size is reduced if needed. 'streamed' is whether the patch goes straight to a file.
+static enum patchtype FitMemory(enum patchtype patchtype, size_t sourcelen, size_t targetlen, bool indexed, bool streamed,
+                                size_t budget, size_t * tablesize)
+{
+	if (patchtype==ty_bps_optimal)
+	{
+		if (bps_create_optimal_memory(sourcelen, targetlen) <= budget) return ty_bps_optimal;
+		patchtype=ty_bps_moremem;
+	}
+	if (patchtype==ty_bps_moremem)
+	{
+		if (bps_create_delta_memory(sourcelen, targetlen, true, indexed) <= budget) return ty_bps_moremem;
+		patchtype=ty_bps;
+	}
+	if (patchtype==ty_bps)
+	{
+		if (bps_create_delta_memory(sourcelen, targetlen, false, indexed) <= budget) return ty_bps;
+		patchtype=ty_bps_hash;
+	}
+	if (patchtype==ty_bps_hash)
+	{
+		//this one doesn't load the files either
+		size_t (*memory)(size_t sourcelen, size_t targetlen, size_t tablesize) =
+			(streamed ? bps_create_hash_file_memory : bps_create_hash_memory);
+		size_t size=(*tablesize ? *tablesize : 64*1024*1024);
+		while (size>8192 && memory(sourcelen, targetlen, size) > budget) size/=2;
+		if (memory(sourcelen, targetlen, size) <= budget)
+		{
+			*tablesize=size;
+			return ty_bps_hash;
+		}
+		patchtype=ty_bps_linear;
+	}
+	if (patchtype==ty_bps_linear)
+	{
+		//this one needs the entire files in memory, unless it's streamed
+		if (streamed && bps_create_linear_stream_memory(sourcelen, targetlen) <= budget) return ty_bps_linear;
+		if (sourcelen+targetlen+bps_create_linear_memory(sourcelen, targetlen) <= budget) return ty_bps_linear;
+		return ty_null;
+	}
+	return patchtype;
+}
+
+//If patchfile is non-NULL, the patch goes straight there, and patchmem is ignored.
+//If 'inrom' is set, that's used instead of reading inromname.
+static struct errorinfo CreatePatchMain(LPCWSTR inromname, const struct loadedrom * inrom, LPCWSTR outromname, enum patchtype patchtype,
+                                        struct manifestinfo * manifestinfo, struct mem * patchmem, filewrite* patchfile)
 {
-	bool usemmap = (patchtype!=ty_bps && patchtype!=ty_bps_moremem);
+	size_t tablesize=hashTableSize;
+	if (patchMemory)
+	{
+		//the headers aren't removed here, but 512 bytes don't matter
+		file* f[2]={inrom ? new fileloaded(inrom) : file::create(inromname), file::create(outromname)};
+		if (f[0] && f[1])
+		{
+			bool indexed=(sourceIndex.ptr!=NULL);
+			enum patchtype fit=FitMemory(patchtype, f[0]->len(), f[1]->len(), indexed, (patchfile!=NULL), patchMemory, &tablesize);
+#ifdef _OPENMP
+#pragma omp critical(createmany)
+#endif
+			{
+				if (fit==ty_null)
+					wprintf(TEXT("%s: not even --bps-linear fits in the memory limit\n"), outromname);
+				else if (fit==ty_bps_hash)
+					wprintf(TEXT("%s: using %s, with at most a %uKB table\n"), outromname, PatchTypeName(fit), (unsigned)(tablesize/1024));
+				else
+					wprintf(TEXT("%s: using %s\n"), outromname, PatchTypeName(fit));
+			}
+			patchtype=fit;
+		}
+		delete f[0];
+		delete f[1];
+		if (patchtype==ty_null) return error(el_broken, "There isn't enough memory to create this patch.");
+	}
+	
+	//a linear patch going to a file is made a few MB at the time, the others need it all mapped
+	bool usemmap = (patchtype!=ty_bps && patchtype!=ty_bps_moremem && patchtype!=ty_bps_optimal && patchtype!=ty_bps_hash &&
+	                !(patchtype==ty_bps_linear && patchfile));
 	
 	//pick roms
 	filemap* romsmap[2]={NULL, NULL};
@@ -979,7 +1310,13 @@ struct errorinfo CreatePatchToMem(LPCWSTR inromname, LPCWSTR outromname, enum pa
 	{
 		LPCWSTR romname=((i==0)?inromname:outromname);
 		
-		if (usemmap)
+		if (i==0 && inrom)
+		{
+			if (usemmap) romsmap[0] = new filemaploaded(inrom);
+			else roms[0] = new fileloaded(inrom);
+			lens[0] = inrom->data.len;
+		}
+		else if (usemmap)
 		{
 			romsmap[i] = filemap::create(romname);
 			
@@ -988,7 +1325,7 @@ struct errorinfo CreatePatchToMem(LPCWSTR inromname, LPCWSTR outromname, enum pa
 				if (i==1) delete romsmap[0];
 				return error(el_broken, "Couldn't read this ROM.");
 			}
-			if (shouldRemoveHeader(romname, romsmap[i]->len()) && (patchtype==ty_bps || patchtype==ty_bps_linear || patchtype==ty_bps_moremem))
+			if (shouldRemoveHeader(romname, romsmap[i]->len()) && (patchtype==ty_bps || patchtype==ty_bps_linear || patchtype==ty_bps_moremem || patchtype==ty_bps_optimal || patchtype==ty_bps_hash))
 			{
 				romsmap[i] = new fileheadermap(romsmap[i]);
 			}
@@ -1004,7 +1341,7 @@ struct errorinfo CreatePatchToMem(LPCWSTR inromname, LPCWSTR outromname, enum pa
 				if (i==1) delete roms[0];
 				return error(el_broken, "Couldn't read this ROM.");
 			}
-			if (shouldRemoveHeader(romname, roms[i]->len()) && (patchtype==ty_bps || patchtype==ty_bps_linear || patchtype==ty_bps_moremem))
+			if (shouldRemoveHeader(romname, roms[i]->len()) && (patchtype==ty_bps || patchtype==ty_bps_linear || patchtype==ty_bps_moremem || patchtype==ty_bps_optimal || patchtype==ty_bps_hash))
 			{
 				roms[i] = new fileheader(roms[i]);
 			}
@@ -1016,39 +1353,110 @@ struct errorinfo CreatePatchToMem(LPCWSTR inromname, LPCWSTR outromname, enum pa
 	struct errorinfo manifesterr={el_ok, NULL};
 	struct manifestinfo defmanifestinfo={true,false,NULL};
 	if (!manifestinfo) manifestinfo=&defmanifestinfo;
-	if (patchtype==ty_bps || patchtype==ty_bps_linear || patchtype==ty_bps_moremem)
+	if (patchtype==ty_bps || patchtype==ty_bps_linear || patchtype==ty_bps_moremem || patchtype==ty_bps_optimal || patchtype==ty_bps_hash)
 	{
 		LPCWSTR manifestname;
-		if (manifestinfo->name) manifestname=manifestinfo->name;
-		else manifestname=GetManifestName(outromname);
-		manifest=ReadWholeFile(manifestname);
+		//GetManifestName isn't thread safe
+#ifdef _OPENMP
+#pragma omp critical(manifestname)
+#endif
+		{
+			if (manifestinfo->name) manifestname=manifestinfo->name;
+			else manifestname=GetManifestName(outromname);
+			manifest=ReadWholeFile(manifestname);
+		}
 		if (!manifest.ptr) manifesterr=error(el_warning, "The patch was created, but the manifest could not be read.");
 	}
 	else manifesterr=error(el_warning, "The patch was created, but this patch format does not support manifests.");
 	
+	bps_delta_ctx* deltactx=NULL;
+	if (deltaContexts)
+	{
+#ifdef _OPENMP
+		deltactx=deltaContexts[omp_get_thread_num()];
+#else
+		deltactx=deltaContexts[0];
+#endif
+	}
+	
 	struct errorinfo errinf={ el_broken, "Unknown patch format." };
 	if (patchtype==ty_ips)
 	{
-		errinf=ipserrors[ips_create(romsmap[0]->get(), romsmap[1]->get(), patchmem)];
+		if (patchfile) errinf=ipserrors[ips_create_file(romsmap[0]->get(), romsmap[1]->get(), patchfile)];
+		else errinf=ipserrors[ips_create(romsmap[0]->get(), romsmap[1]->get(), patchmem)];
 	}
-	if (patchtype==ty_bps || patchtype==ty_bps_moremem)
+	if (patchtype==ty_ups)
+	{
+		if (patchfile) errinf=bpserrors[ups_create_file(romsmap[0]->get(), romsmap[1]->get(), patchfile, inrom ? &inrom->crc : NULL)];
+		else errinf=bpserrors[ups_create(romsmap[0]->get(), romsmap[1]->get(), patchmem)];
+	}
+	if ((patchtype==ty_bps || patchtype==ty_bps_moremem) && (deltactx || printStats))
+	{
+		//only reachable from the command line; handles both with and without index
+		struct bps_stats stats;
+		memset(&stats, 0, sizeof(stats));
+		errinf=bpserrors[bps_create_delta_ctx(deltactx, roms[0], sourceIndex, roms[1], manifest, patchmem, patchfile,
+		                                      showProgress ? bpsdeltaProgressCLI : NULL, NULL,
+		                                      (patchtype==ty_bps_moremem), printStats ? &stats : NULL)];
+		if (printStats)
+		{
+#ifdef _OPENMP
+#pragma omp critical(createmany)
+#endif
+			PrintBpsStats(outromname, &stats);
+		}
+	}
+	else if ((patchtype==ty_bps || patchtype==ty_bps_moremem) && sourceIndex.ptr)
+	{
+		//only reachable from the command line
+		if (patchfile)
+			errinf=bpserrors[bps_create_delta_indexed_file(roms[0], sourceIndex, roms[1], manifest, patchfile,
+			                                               showProgress ? bpsdeltaProgressCLI : NULL, NULL,
+			                                               (patchtype==ty_bps_moremem))];
+		else
+			errinf=bpserrors[bps_create_delta_indexed(roms[0], sourceIndex, roms[1], manifest, patchmem,
+			                                          showProgress ? bpsdeltaProgressCLI : NULL, NULL,
+			                                          (patchtype==ty_bps_moremem))];
+	}
+	else if (patchtype==ty_bps || patchtype==ty_bps_moremem)
 	{
 #ifndef FLIPS_CLI
 		if (guiActive)
 		{
 			bpsdeltaBegin();
-			errinf=bpserrors[bps_create_delta(roms[0], roms[1], manifest, patchmem, bpsdeltaProgress, NULL, (patchtype==ty_bps_moremem))];
+			if (patchfile) errinf=bpserrors[bps_create_delta_file(roms[0], roms[1], manifest, patchfile, bpsdeltaProgress, NULL, (patchtype==ty_bps_moremem))];
+			else errinf=bpserrors[bps_create_delta(roms[0], roms[1], manifest, patchmem, bpsdeltaProgress, NULL, (patchtype==ty_bps_moremem))];
 			bpsdeltaEnd();
 		}
 		else
 #endif
 		{
-			errinf=bpserrors[bps_create_delta(roms[0], roms[1], manifest, patchmem, bpsdeltaProgressCLI, NULL, (patchtype==ty_bps_moremem))];
+			if (patchfile)
+				errinf=bpserrors[bps_create_delta_file(roms[0], roms[1], manifest, patchfile, showProgress ? bpsdeltaProgressCLI : NULL, NULL,
+				                                       (patchtype==ty_bps_moremem))];
+			else
+				errinf=bpserrors[bps_create_delta(roms[0], roms[1], manifest, patchmem, showProgress ? bpsdeltaProgressCLI : NULL, NULL,
+				                                  (patchtype==ty_bps_moremem))];
 		}
 	}
+	if (patchtype==ty_bps_optimal)
+	{
+		if (patchfile) errinf=bpserrors[bps_create_optimal_file(roms[0], roms[1], manifest, patchfile, showProgress ? bpsdeltaProgressCLI : NULL, NULL, false)];
+		else errinf=bpserrors[bps_create_optimal(roms[0], roms[1], manifest, patchmem, showProgress ? bpsdeltaProgressCLI : NULL, NULL, false)];
+	}
+	if (patchtype==ty_bps_hash)
+	{
+		if (patchfile)
+			errinf=bpserrors[bps_create_hash_file(roms[0], roms[1], manifest, patchfile, showProgress ? bpsdeltaProgressCLI : NULL, NULL,
+			                                      tablesize)];
+		else
+			errinf=bpserrors[bps_create_hash(roms[0], roms[1], manifest, patchmem, showProgress ? bpsdeltaProgressCLI : NULL, NULL,
+			                                 tablesize)];
+	}
 	if (patchtype==ty_bps_linear)
 	{
-		errinf=bpserrors[bps_create_linear(romsmap[0]->get(), romsmap[1]->get(), manifest, patchmem)];
+		if (patchfile) errinf=bpserrors[bps_create_linear_stream(roms[0], roms[1], manifest, patchfile)];
+		else errinf=bpserrors[bps_create_linear(romsmap[0]->get(), romsmap[1]->get(), manifest, patchmem)];
 	}
 	FreeFileMemory(manifest);
 	if (errinf.level==el_ok) errinf.description="The patch was created successfully!";
@@ -1075,17 +1483,62 @@ struct errorinfo CreatePatchToMem(LPCWSTR inromname, LPCWSTR outromname, enum pa
 	return errinf;
 }
 
+struct errorinfo CreatePatchToMem(LPCWSTR inromname, LPCWSTR outromname, enum patchtype patchtype,
+                                  struct manifestinfo * manifestinfo, struct mem * patchmem)
+{
+	return CreatePatchMain(inromname, NULL, outromname, patchtype, manifestinfo, patchmem, NULL);
+}
+
+static struct errorinfo CreatePatch(LPCWSTR inromname, const struct loadedrom * inrom, LPCWSTR outromname, enum patchtype patchtype,
+                                    struct manifestinfo * manifestinfo, LPCWSTR patchname)
+{
+	//the patch is written as it's created, so a huge TargetRead doesn't need to fit in memory twice
+	//it goes to a file beside it first, so if it fails, an older patch with that name isn't lost
+	LPWSTR tempname = CreateTempFile(patchname);
+	if (!tempname) return error(el_broken, "Couldn't write patch.");
+	
+	filewrite* patch = filewrite::create(tempname);
+	if (!patch)
+	{
+		RemoveFile(tempname);
+		free(tempname);
+		return error(el_broken, "Couldn't write patch.");
+	}
+	struct errorinfo errinf = CreatePatchMain(inromname, inrom, outromname, patchtype, manifestinfo, NULL, patch);
+	delete patch;
+	
+	if (errinf.level<el_notthis)
+	{
+		if (!MoveFileOver(tempname, patchname)) errinf = error(el_broken, "Couldn't write patch.");
+	}
+	//don't leave half a patch lying around
+	if (errinf.level>=el_notthis) RemoveFile(tempname);
+	free(tempname);
+	return errinf;
+}
+
 struct errorinfo CreatePatch(LPCWSTR inromname, LPCWSTR outromname, enum patchtype patchtype,
                              struct manifestinfo * manifestinfo, LPCWSTR patchname)
 {
-	struct mem patch={NULL,0};
-	struct errorinfo errinf = CreatePatchToMem(inromname, outromname, patchtype, manifestinfo, &patch);
+	return CreatePatch(inromname, NULL, outromname, patchtype, manifestinfo, patchname);
+}
+
+struct errorinfo CreateIndex(LPCWSTR romname, bool lcp, LPCWSTR indexname)
+{
+	file* rom = file::create(romname);
+	if (!rom) return error(el_broken, "Couldn't read this ROM.");
+	if (shouldRemoveHeader(romname, rom->len())) rom = new fileheader(rom);
+	
+	struct mem index={NULL,0};
+	struct errorinfo errinf=bpserrors[bps_index_create(rom, lcp, &index)];
+	delete rom;
+	if (errinf.level==el_ok) errinf.description="The index was created successfully!";
 	
 	if (errinf.level<el_notthis)
 	{
-		if (!WriteWholeFile(patchname, patch)) errinf=error(el_broken, "Couldn't write patch.");
+		if (!WriteWholeFile(indexname, index)) errinf=error(el_broken, "Couldn't write index.");
 	}
-	if (patch.ptr) free(patch.ptr);
+	bps_free(index);
 	return errinf;
 }
 
@@ -1194,18 +1647,21 @@ void usage()
 #endif
 	     "flips [--apply] [--exact] patch.bps rom.smc [outrom.smc]\n"
 	  "or flips [--create] [--exact] [--bps | etc] clean.smc hack.smc [patch.bps]\n"
+	  "or flips --index [--exact] [--bps-delta-moremem] clean.smc clean.idx\n"
+	  "or flips --create-many [--bps | etc] clean.smc hack1.smc hack2.smc (...) --outdir dir\n"
 	  "\n"
 	// 12345678901234567890123456789012345678901234567890123456789012345678901234567890
 	  "options:\n"
 	  "-a --apply: apply IPS, BPS or UPS patch (default if given two arguments)\n"
 	  "  if output filename is not given, Flips defaults to patch.smc beside the patch\n"
-	  "-c --create: create IPS or BPS patch (default if given three arguments)\n"
+	  "-c --create: create IPS, BPS or UPS patch (default if given three arguments)\n"
 	  "-I --info: BPS files contain information about input and output roms, print it\n"
 	  "  with --verbose, disassemble the entire patch\n"
 	  //"  also estimates how much of the source file is retained\n"
 	  //"  anything under 400 is fine, anything over 600 should be treated with suspicion\n"
 	  //(TODO: --info --verbose)
-	  "-i --ips, -b -B --bps --bps-delta, --bps-delta-moremem, --bps-linear:\n"
+	  "-i --ips, -b -B --bps --bps-delta, --bps-delta-moremem, --bps-linear, --bps-optimal,\n"
+	  "  --bps-hash, --ups:\n"
 	  "  create this patch format instead of guessing based on file extension\n"
 	  "  ignored when applying\n"
 	  " bps creation styles:\n"
@@ -1214,11 +1670,31 @@ void usage()
 	  "  delta-moremem is usually slightly (~3%) faster than delta, but uses about\n"
 	  "    twice as much memory; it gives identical patches to delta\n"
 	  "  linear is the fastest, but tends to give pretty big patches\n"
+	  "  optimal gives a few percent smaller patches than delta, but is 2-3 times\n"
+	  "    slower and uses more memory\n"
+	  "  hash is almost as fast as linear and uses little memory, but the patches are\n"
+	  "    bigger than delta; it's intended for files of several gigabytes\n"
 	  "  all BPS patchers can apply all patch styles, the only difference is file size\n"
 	  "    and creation performance\n"
+	  "--hash-table=N: use N megabytes for the --bps-hash table (default up to 64)\n"
+	  "--max-memory=N: use at most about N megabytes when creating BPS patches; if the\n"
+	  "  chosen method needs more, a faster one with bigger patches is used instead\n"
+	  "  with --create-many, fewer patches are created at once\n"
+	  "  it's an estimate, not a hard cap; if not even --bps-linear fits, the patch\n"
+	  "    isn't created, there is no slower low-memory fallback\n"
+	  "--index: sort clean.smc ahead of time, for creating many BPS patches from it\n"
+	  "  with --bps-delta-moremem, the index is twice as big, but patching is faster\n"
+	  "--source-index=clean.idx: use that index when creating a BPS patch\n"
+	  "  only --bps-delta and --bps-delta-moremem can use it; if --max-memory picks\n"
+	  "    another method, the index is ignored\n"
+	  "  --exact must be the same as when the index was created\n"
+	  "--create-many: create one patch per hack, all from the same clean ROM, into the\n"
+	  "  given directory; the clean ROM is only sorted once, and they're made in parallel\n"
 	  "--exact: do not remove SMC headers when applying or creating a BPS patch\n"
 	  "    not recommended, may affect patcher compatibility\n"
 	  "--ignore-checksum: accept checksum mismatches (BPS only)\n"
+	  "--stats: show how long each part of creating or applying the patch took, and\n"
+	  "  what the patch consists of (BPS delta creation, BPS and IPS application)\n"
 	  "-m or --manifest: emit or insert a manifest file as romname.xml (BPS only)\n"
 	  "-mfilename or --manifest=filename: emit or insert a manifest file exactly here\n"
 	  "-h -? --help: show this information\n"
@@ -1237,11 +1713,15 @@ int error_to_exit(errorlevel level)
 int flipsmain(int argc, WCHAR * argv[])
 {
 	enum patchtype patchtype=ty_null;
-	enum { a_default, a_apply_filepicker, a_apply_given, a_create, a_info } action=a_default;
+	enum { a_default, a_apply_filepicker, a_apply_given, a_create, a_create_many, a_info, a_index } action=a_default;
 	int numargs=0;
-	LPCWSTR arg[3]={NULL,NULL,NULL};
+	LPCWSTR* arg=(LPCWSTR*)malloc(sizeof(LPCWSTR)*(argc+3)); // only --create-many takes more than 3
+	for (int i=0;i<argc+3;i++) arg[i]=NULL;
 	bool hasFlags=false;
 	int verbosity = 0;
+	LPCWSTR sourceIndexName=NULL;
+	LPCWSTR outdir=NULL;
+	size_t maxMemory=0;
 	
 	bool ignoreChecksum=false;
 	
@@ -1273,11 +1753,36 @@ int flipsmain(int argc, WCHAR * argv[])
 				if (action==a_default) action=a_info;
 				else usage();
 			}
+			else if (!wcscmp(argv[i], TEXT("--create-many")))
+			{
+				if (action==a_default) action=a_create_many;
+				else usage();
+			}
+			else if (!wcscmp(argv[i], TEXT("--outdir")))
+			{
+				if (outdir || i+1==argc) usage();
+				outdir=argv[++i];
+			}
+			else if (!wcscmp(argv[i], TEXT("--index"))) // no short form, -i is taken
+			{
+				if (action==a_default) action=a_index;
+				else usage();
+			}
+			else if (!wcsncmp(argv[i], TEXT("--source-index="), wcslen(TEXT("--source-index="))))
+			{
+				if (sourceIndexName) usage();
+				sourceIndexName=argv[i]+wcslen(TEXT("--source-index="));
+			}
 			else if (!wcscmp(argv[i], TEXT("--ips")) || !wcscmp(argv[i], TEXT("-i")))
 			{
 				if (patchtype==ty_null) patchtype=ty_ips;
 				else usage();
 			}
+			else if (!wcscmp(argv[i], TEXT("--ups")))
+			{
+				if (patchtype==ty_null) patchtype=ty_ups;
+				else usage();
+			}
 			else if (!wcscmp(argv[i], TEXT("--bps")) || !wcscmp(argv[i], TEXT("--bps-delta")) ||
 			         !wcscmp(argv[i], TEXT("-b")) || !wcscmp(argv[i], TEXT("-B")))
 			{
@@ -1294,6 +1799,28 @@ int flipsmain(int argc, WCHAR * argv[])
 				if (patchtype==ty_null) patchtype=ty_bps_linear;
 				else usage();
 			}
+			else if (!wcscmp(argv[i], TEXT("--bps-optimal")))
+			{
+				if (patchtype==ty_null) patchtype=ty_bps_optimal;
+				else usage();
+			}
+			else if (!wcscmp(argv[i], TEXT("--bps-hash")))
+			{
+				if (patchtype==ty_null) patchtype=ty_bps_hash;
+				else usage();
+			}
+			else if (!wcsncmp(argv[i], TEXT("--hash-table="), wcslen(TEXT("--hash-table="))))
+			{
+				int mb=wtoi(argv[i]+wcslen(TEXT("--hash-table=")));
+				if (mb<=0 || hashTableSize) usage();
+				hashTableSize=(size_t)mb*1024*1024;
+			}
+			else if (!wcsncmp(argv[i], TEXT("--max-memory="), wcslen(TEXT("--max-memory="))))
+			{
+				int mb=wtoi(argv[i]+wcslen(TEXT("--max-memory=")));
+				if (mb<=0 || maxMemory) usage();
+				maxMemory=(size_t)mb*1024*1024;
+			}
 			else if (!wcscmp(argv[i], TEXT("--exact"))) // no short form
 			{
 				if (forceKeepHeader) usage();
@@ -1304,6 +1831,11 @@ int flipsmain(int argc, WCHAR * argv[])
 				if (ignoreChecksum) usage();
 				ignoreChecksum=true;
 			}
+			else if (!wcscmp(argv[i], TEXT("--stats")))
+			{
+				if (printStats) usage();
+				printStats=true;
+			}
 			else if (!wcscmp(argv[i], TEXT("--manifest")) || !wcscmp(argv[i], TEXT("-m")))
 			{
 				manifestinfo.use=true;
@@ -1336,10 +1868,26 @@ int flipsmain(int argc, WCHAR * argv[])
 #endif
 		else
 		{
-			if (numargs==3) usage();
 			arg[numargs++]=argv[i];
 		}
 	}
+	if (numargs>3 && action!=a_create_many) usage();
+	if (outdir && action!=a_create_many) usage();
+	
+	filemap* indexmap=NULL;
+	if (sourceIndexName)
+	{
+		if (action!=a_create && action!=a_create_many && !(action==a_default && numargs==3)) usage();
+		//the other methods don't sort the source, so they'd just ignore it
+		if (patchtype!=ty_null && patchtype!=ty_bps && patchtype!=ty_bps_moremem) usage();
+		indexmap=filemap::create_mmap(sourceIndexName);
+		if (!indexmap)
+		{
+			puts("Couldn't read source index.");
+			return error_to_exit(el_broken);
+		}
+		sourceIndex=indexmap->get();
+	}
 	if (action==a_default)
 	{
 		if (numargs==0) action=a_default;
@@ -1412,8 +1960,11 @@ int flipsmain(int argc, WCHAR * argv[])
 				wcscpy(arg2, arg[1]);
 				GetExtension(arg2)[0]='\0';
 				if (patchtype==ty_ips) wcscat(arg2, TEXT(".ips"));
+				if (patchtype==ty_ups) wcscat(arg2, TEXT(".ups"));
 				if (patchtype==ty_bps) wcscat(arg2, TEXT(".bps"));
 				if (patchtype==ty_bps_linear) wcscat(arg2, TEXT(".bps"));
+				if (patchtype==ty_bps_optimal) wcscat(arg2, TEXT(".bps"));
+				if (patchtype==ty_bps_hash) wcscat(arg2, TEXT(".bps"));
 			}
 			if (patchtype==ty_null)
 			{
@@ -1424,22 +1975,181 @@ int flipsmain(int argc, WCHAR * argv[])
 					return el_broken;
 				}
 				else if (!wcsicmp(patchext, TEXT(".ips"))) patchtype=ty_ips;
+				else if (!wcsicmp(patchext, TEXT(".ups"))) patchtype=ty_ups;
 				else if (!wcsicmp(patchext, TEXT(".bps"))) patchtype=ty_bps;
 				else
 				{
 					wprintf(TEXT("Error: Unknown patch type (%s)\n"), patchext);
 					return error_to_exit(el_broken);
 				}
+				if (sourceIndex.ptr && patchtype!=ty_bps) usage();
 			}
+			patchMemory=maxMemory;
 			struct errorinfo errinf=CreatePatch(arg[0], arg[1], patchtype, &manifestinfo, arg[2]);
+			delete indexmap;
 			puts(errinf.description);
 			return error_to_exit(errinf.level);
 		}
+		case a_create_many:
+		{
+			if (numargs<2 || !outdir) usage();
+			if (manifestinfo.name) usage(); // they'd all go to the same file
+			GUIClaimConsole();
+			if (patchtype==ty_null) patchtype=ty_bps;
+			LPCWSTR ext=(patchtype==ty_ips ? TEXT(".ips") : patchtype==ty_ups ? TEXT(".ups") : TEXT(".bps"));
+			
+			//only the base name is kept, so hacks from different directories can end up with the same patch
+			// name; they'd overwrite each other, possibly both at once, so that's refused before anything is done
+			//some file systems ignore case, so names differing only in case count as the same
+			LPWSTR* outnames=(LPWSTR*)malloc(sizeof(LPWSTR)*numargs);
+			bool dupes=false;
+			for (int i=1;i<numargs;i++)
+			{
+				LPCWSTR basename=GetBaseName(arg[i]);
+				outnames[i]=(WCHAR*)malloc(sizeof(WCHAR)*(wcslen(outdir)+1+wcslen(basename)+4+1));
+				wcscpy(outnames[i], outdir);
+				wcscat(outnames[i], TEXT("/"));
+				wcscat(outnames[i], basename);
+				wcscpy(GetExtension(outnames[i]), ext);
+				
+				for (int j=1;j<i;j++)
+				{
+					if (!wcsicmp(outnames[i], outnames[j]))
+					{
+						wprintf(TEXT("%s and %s would both be written to %s\n"), arg[j], arg[i], outnames[i]);
+						dupes=true;
+						break;
+					}
+				}
+			}
+			if (dupes)
+			{
+				for (int i=1;i<numargs;i++) free(outnames[i]);
+				free(outnames);
+				delete indexmap;
+				free(arg);
+				return error_to_exit(el_broken);
+			}
+			
+			//the clean ROM is read and checksummed only once, and shared by every patch
+			filemap* basemap=filemap::create(arg[0]);
+			if (!basemap)
+			{
+				puts("Couldn't read this ROM.");
+				for (int i=1;i<numargs;i++) free(outnames[i]);
+				free(outnames);
+				delete indexmap;
+				free(arg);
+				return error_to_exit(el_broken);
+			}
+			if (patchtype!=ty_ips && patchtype!=ty_ups && shouldRemoveHeader(arg[0], basemap->len()))
+			{
+				basemap=new fileheadermap(basemap);
+			}
+			struct loadedrom base={ basemap->get(), crc32(basemap->ptr(), basemap->len()) };
+			
+			//the source is sorted only once too
+			struct mem ownindex={NULL,0};
+			bool makeindex=((patchtype==ty_bps || patchtype==ty_bps_moremem) && !sourceIndex.ptr);
+			
+			//with a memory limit, run fewer patches at once rather than picking a worse method, and
+			// skip the index if it doesn't fit together with at least one patch
+			int threads=1;
+#ifdef _OPENMP
+			threads=omp_get_max_threads();
+#endif
+			if (maxMemory)
+			{
+				size_t sourcelen=base.data.len;
+				size_t targetlen=0;
+				for (int i=1;i<numargs;i++)
+				{
+					file* f=file::create(arg[i]);
+					if (!f) continue;
+					if (f->len()>targetlen) targetlen=f->len();
+					delete f;
+				}
+				size_t budget=maxMemory;
+				size_t tablesize=hashTableSize;
+				if (makeindex)
+				{
+					size_t indexmem=bps_index_memory(sourcelen, (patchtype==ty_bps_moremem));
+					if (indexmem+sourcelen<=budget && FitMemory(patchtype, sourcelen, targetlen, true, true, budget-indexmem, &tablesize)==patchtype)
+						budget-=indexmem;
+					else makeindex=false;
+				}
+				bool indexed=(makeindex || sourceIndex.ptr);
+				while (threads>1 && FitMemory(patchtype, sourcelen, targetlen, indexed, true, budget/threads, &tablesize)!=patchtype) threads--;
+				patchMemory=budget/threads;
+			}
+			
+			if (makeindex)
+			{
+				fileloaded rom(&base);
+				struct errorinfo errinf=bpserrors[bps_index_create(&rom, (patchtype==ty_bps_moremem), &ownindex)];
+				if (errinf.level!=el_ok)
+				{
+					puts(errinf.description);
+					bps_free(ownindex);
+					delete basemap;
+					for (int i=1;i<numargs;i++) free(outnames[i]);
+					free(outnames);
+					delete indexmap;
+					free(arg);
+					return error_to_exit(errinf.level);
+				}
+				sourceIndex=ownindex;
+			}
+			
+			//the arrays are reused from one patch to the next, rather than mapped and freed every time
+			deltaContexts=(bps_delta_ctx**)malloc(sizeof(bps_delta_ctx*)*threads);
+			for (int i=0;i<threads;i++) deltaContexts[i]=bps_delta_ctx_create();
+			
+			//the progress meter can't show more than one patch at the time
+			showProgress=false;
+			errorlevel worsterror=el_ok;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+#endif
+			for (int i=1;i<numargs;i++)
+			{
+				LPCWSTR outname=outnames[i];
+				struct errorinfo errinf=CreatePatch(arg[0], &base, arg[i], patchtype, &manifestinfo, outname);
+#ifdef _OPENMP
+#pragma omp critical(createmany)
+#endif
+				{
+					wprintf(TEXT("%s: %s\n"), outname, errinf.description);
+					if (errinf.level>worsterror) worsterror=errinf.level;
+				}
+			}
+			
+			for (int i=0;i<threads;i++) bps_delta_ctx_free(deltaContexts[i]);
+			free(deltaContexts);
+			deltaContexts=NULL;
+			
+			bps_free(ownindex);
+			delete basemap;
+			for (int i=1;i<numargs;i++) free(outnames[i]);
+			free(outnames);
+			delete indexmap;
+			free(arg);
+			return error_to_exit(worsterror);
+		}
 		case a_info:
 		{
 			if (numargs!=1) usage();
 			return error_to_exit(patchinfo(arg[0], &manifestinfo, verbosity));
 		}
+		case a_index:
+		{
+			if (numargs!=2) usage();
+			if (patchtype!=ty_null && patchtype!=ty_bps && patchtype!=ty_bps_moremem) usage();
+			GUIClaimConsole();
+			struct errorinfo errinf=CreateIndex(arg[0], (patchtype==ty_bps_moremem), arg[1]);
+			puts(errinf.description);
+			return error_to_exit(errinf.level);
+		}
 	}
 	return 99;//doesn't happen
 }
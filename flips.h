@@ -160,6 +160,8 @@ enum patchtype {
 	ty_bps_linear,
 	ty_bps_moremem,
 	ty_ups,
+	ty_bps_optimal,
+	ty_bps_hash,
 	
 	ty_shut_up_gcc
 };
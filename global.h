@@ -19,6 +19,13 @@ struct mem {
 	size_t len;
 };
 
+//How long a part of a patcher took, in seconds; see phasetime.h. 'cpu' is summed over all threads,
+// so it can be bigger than 'wall'.
+struct phase_time {
+	double wall;
+	double cpu;
+};
+
 #if defined(FLIPS_WINDOWS)
 #define LPCWSTR const wchar_t *
 #else
@@ -36,6 +43,9 @@ public:
 	
 	virtual size_t len() = 0;
 	virtual bool read(uint8_t* target, size_t start, size_t len) = 0;
+	//If the CRC32 of the file is known without reading it, for example because it's been read already,
+	// sets 'crc' and returns true. The BPS creators use it to not checksum the same source every time.
+	virtual bool known_crc32(uint32_t* crc) { (void)crc; return false; }
 	
 	//these two add sizeof(WCHAR) 00s after the actual data, so you can cast it to LPCWSTR
 	static struct mem read(LPCWSTR filename); // provided by Flips core
@@ -48,6 +58,10 @@ class filemap {
 public:
 	static filemap* create(LPCWSTR filename);
 	static filemap* create_fallback(LPCWSTR filename);
+	//Maps the file exactly, if the platform can, even where create() doesn't. Some of the patch
+	// creators read a few bytes outside their inputs, which is harmless on a malloc'd buffer but not
+	// on an exactly sized mapping, so this is only for things that are known to stay in bounds.
+	static filemap* create_mmap(LPCWSTR filename); // provided by Flips core
 	
 	virtual size_t len() = 0;
 	virtual const uint8_t * ptr() = 0;
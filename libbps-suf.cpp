@@ -6,6 +6,11 @@
 
 #include "libbps.h"
 #include "crc32.h"
+#include "bytecmp.h"
+#include "phasetime.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,6 +29,19 @@
 //If it's something else, get a non-broken array calculator.
 #define EOF_IS_LAST false
 
+//If true, the moremem creator also builds an LCP array for each pass, so adjust_match doesn't need to
+// compare the two candidates with each other. It gives identical patches, but Kasai's algorithm costs
+// far more than it saves; a 5MB->24MB test took 7.6s with this, 5.0s without.
+//An LCP array in a source index is always used, since it costs nothing at that point.
+#define USE_LCP false
+
+//If true, the big arrays of the delta creator are allocated with mmap and 2MB huge pages, and their
+// pages are faulted in on all threads up front. They're accessed randomly, so with 4KB pages, much
+// of the time goes to TLB misses. Only does anything on Linux; elsewhere, it's plain malloc.
+#ifndef USE_BIGALLOC
+#define USE_BIGALLOC true
+#endif
+
 #if defined(TEST_CORRECT) || defined(TEST_PERF)
 #include <stdio.h>
 #endif
@@ -42,8 +60,9 @@
 // that either starts before the current output position, or is somewhere in the source file.
 //As the source file comes last, the end-of-file marker (whose value is outside the range of a byte)
 // is guaranteed to not be in the way for a better match.
-//This is called O(n) times, and averages O(1) as at least 50% of sorted[] is in range. However, it
-// is worst-case O(n) for sorted inputs, giving a total of O(n^2).
+//This is called O(n) times, and averages O(1) as at least 50% of sorted[] is in range. It's worst-case
+// O(n) for sorted inputs, so after a few steps, it switches to a tree of block minimums, which finds
+// the closest valid entry in O(log n).
 //
 //It then checks which of the two candidates are superior, by checking how far they match each
 // other, and then checking if the upper one has another correct byte.
@@ -55,10 +74,13 @@
 //Given O(n log n) for one sorting step, the time taken is O(n/1 log n/1 + n/2 log n/2 +
 // n/4 log n/4 + ...), which is strictly less than O(n/1 log n + n/2 log n + n/4 log n + ...), which
 // equals O(2n log n), which is O(n log n). (The exact value of that infinite sum is 2n*log(n/2).)
+//The source is only sorted once, though; a suffix array of the source alone is the same as the source
+// part of the first pass, so the later passes only sort the target, and search the source separately
+// by binary search. There's only more than one pass if the target is much bigger than the source.
 //
 //Many details were omitted from the above, but that's the basic setup.
 //
-//Thus, the program is O(max(n log n, n, n) = n log n) average and O(max(n log n, n^2, n) = n^2)
+//Thus, the program is O(max(n log n, n, n) = n log n) average and O(max(n log n, n log n, n) = n log n)
 // worst case.
 //
 //I conclude that the task of finding, understanding and implementing a sub-O(n^2) algorithm for
@@ -144,14 +166,158 @@ template<typename T> static T max(T a, T b) { return a<b ? b : a; }
 
 
 
+#if defined(__linux__) && USE_BIGALLOC
+#include <sys/mman.h>
+
+//The mapping is padded so the returned pointer can be aligned to a huge page; the real mapping is
+// stored right before it.
+struct bigalloc_head {
+	void* base;
+	size_t len;
+};
+static const size_t bigalloc_align = 2*1024*1024;
+
+static void* big_malloc(size_t len)
+{
+	//below a few huge pages, it's not worth it
+	if (len < bigalloc_align*2) return malloc(len);
+	
+	size_t maplen = len + bigalloc_align;
+	if (maplen < len) return NULL;
+	uint8_t* base = (uint8_t*)mmap(NULL, maplen, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) return NULL;
+	
+	uint8_t* ret = (uint8_t*)(((uintptr_t)base + bigalloc_align) & ~(uintptr_t)(bigalloc_align-1));
+	madvise(ret, len, MADV_HUGEPAGE); // if the kernel doesn't know this one, ignore it
+	
+	bigalloc_head* head = (bigalloc_head*)ret - 1;
+	head->base = base;
+	head->len = maplen;
+	
+	//the first touch of each page is what allocates it; spread that over all threads, rather than
+	// having the single threaded reader and sorter do it
+	size_t pages = (len + 4095) / 4096;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (ptrdiff_t i=0;i<(ptrdiff_t)pages;i++) ret[i*4096] = 0;
+	
+	return ret;
+}
+
+//'len' must be the same as given to big_malloc.
+static void big_free(void* ptr, size_t len)
+{
+	if (!ptr) return;
+	if (len < bigalloc_align*2) return free(ptr);
+	bigalloc_head* head = (bigalloc_head*)ptr - 1;
+	munmap(head->base, head->len);
+}
+
+//How much big_malloc(len) really costs; the padding is mapped too, and huge pages round up the end.
+static size_t big_malloc_size(size_t len)
+{
+	if (len < bigalloc_align*2) return len;
+	return len + bigalloc_align;
+}
+#else
+static void* big_malloc(size_t len) { return malloc(len); }
+static void big_free(void* ptr, size_t len) { free(ptr); }
+static size_t big_malloc_size(size_t len) { return len; }
+#endif
+
+
+
+//A bps_delta_ctx keeps the creator's arrays between patches. They only grow, so a patch that's no
+// bigger than the previous one reuses the same pages, already faulted in, rather than mapping new ones.
+struct bps_ctx_array {
+	void* ptr;
+	size_t len;
+};
+struct bps_delta_ctx {
+	bps_ctx_array joined;
+	bps_ctx_array sorted;
+	bps_ctx_array sorted_inverse;
+	bps_ctx_array lcp;
+	bps_ctx_array buckets;
+	bps_ctx_array srcbuckets;
+	bps_ctx_array chunkpos;
+	bps_ctx_array chunklen;
+	
+	//the patch buffer; it's given away if the patch is returned in memory, so it's only reused with a filewrite
+	uint8_t* out;
+	size_t outbuflen;
+	
+	//the last source index that passed bps_index_check, so it's only checked once
+	const uint8_t* checkedindex;
+	size_t checkedindexlen;
+};
+
+//Without a context, these are the same as big_malloc/big_free.
+static void* ctx_malloc(bps_delta_ctx* ctx, bps_ctx_array bps_delta_ctx::* which, size_t len)
+{
+	if (!ctx) return big_malloc(len);
+	bps_ctx_array& arr = ctx->*which;
+	if (!arr.ptr || arr.len < len)
+	{
+		big_free(arr.ptr, arr.len);
+		arr.ptr = big_malloc(len);
+		arr.len = (arr.ptr ? len : 0);
+	}
+	return arr.ptr;
+}
+
+//With a context, the array stays there for the next patch; bps_delta_ctx_free releases it.
+static void ctx_free(bps_delta_ctx* ctx, void* ptr, size_t len)
+{
+	if (!ctx) big_free(ptr, len);
+}
+
+struct bps_delta_ctx* bps_delta_ctx_create()
+{
+	return (bps_delta_ctx*)calloc(1, sizeof(bps_delta_ctx));
+}
+
+void bps_delta_ctx_free(struct bps_delta_ctx* ctx)
+{
+	if (!ctx) return;
+	bps_ctx_array* arrays[] = { &ctx->joined, &ctx->sorted, &ctx->sorted_inverse, &ctx->lcp,
+	                            &ctx->buckets, &ctx->srcbuckets, &ctx->chunkpos, &ctx->chunklen };
+	for (size_t i=0;i<sizeof(arrays)/sizeof(*arrays);i++) big_free(arrays[i]->ptr, arrays[i]->len);
+	free(ctx->out);
+	free(ctx);
+}
+
+
+
 namespace {
 struct bps_creator {
 	uint8_t* out;
 	size_t outlen;
 	size_t outbuflen;
 	
+	//If there's a sink, out[] is sent there whenever it gets this big, and the CRC is updated; there's
+	// no need to keep the entire patch in memory. outlen is then the size of the unsent part only.
+	filewrite* sink;
+	bool sinkok;
+	bool holdflush; // set while the optimal parser may rewind outlen
+	uint32_t outcrc; // of everything already sent
+	enum { flushsize = 1024*1024 };
+	
+	bool sourcecrcknown;
+	uint32_t sourcecrc;
+	
+	void flush()
+	{
+		if (!outlen) return;
+		outcrc = crc32_update(out, outlen, outcrc);
+		if (!sink->append(out, outlen)) sinkok = false;
+		outlen = 0;
+	}
+	
 	void reserve(size_t len)
 	{
+		if (sink && !holdflush && outlen+len > flushsize) flush();
 		if (outlen+len > outbuflen)
 		{
 			if (!outbuflen) outbuflen = 128;
@@ -162,6 +328,14 @@ struct bps_creator {
 	
 	void append(const uint8_t * data, size_t len)
 	{
+		//a big TargetRead goes straight to the sink
+		if (sink && !holdflush && len >= flushsize)
+		{
+			flush();
+			outcrc = crc32_update(data, len, outcrc);
+			if (!sink->append(data, len)) sinkok = false;
+			return;
+		}
 		reserve(len);
 		memcpy(out+outlen, data, len);
 		outlen+=len;
@@ -200,7 +374,8 @@ struct bps_creator {
 	
 	size_t sourcelen;
 	size_t targetlen;
-	const uint8_t* targetmem;
+	const uint8_t* targetmem; // target byte 'targetmemstart' is at targetmem[0]
+	size_t targetmemstart;
 	
 	enum bpscmd { SourceRead, TargetRead, SourceCopy, TargetCopy };
 	
@@ -211,21 +386,60 @@ struct bps_creator {
 	
 	size_t numtargetread;
 	
-	bps_creator(file* source, file* target, struct mem metadata)
+	//if there's only one command and it's SourceRead, the files are identical
+	size_t numcmds;
+	bpscmd firstcmd;
+	
+	//if set, the command counts and time spent go here
+	bps_stats* stats;
+	size_t cmd_count[4];
+	size_t cmd_bytes[4];
+	
+	//for the optimal parser; if these are set, match() only records the match for each position, and
+	// finish() picks the best combination of them
+	uint32_t* candpos;
+	uint32_t* candlen; // top bit set if the match is in the target
+	
+	bps_delta_ctx* ctx;
+	
+	bps_creator(file* source, file* target, struct mem metadata, filewrite* sink = NULL, bps_delta_ctx* ctx = NULL)
 	{
+		this->ctx = ctx;
 		outlen = 0;
-		outbuflen = 128;
-		out = (uint8_t*)malloc(outbuflen);
+		if (ctx && ctx->out)
+		{
+			out = ctx->out;
+			outbuflen = ctx->outbuflen;
+			ctx->out = NULL;
+		}
+		else
+		{
+			outbuflen = 128;
+			out = (uint8_t*)malloc(outbuflen);
+		}
+		
+		this->sink = sink;
+		sinkok = true;
+		holdflush = false;
+		outcrc = 0;
 		
 		outpos = 0;
 		
 		sourcelen = source->len();
 		targetlen = target->len();
+		sourcecrcknown = source->known_crc32(&sourcecrc);
 		
 		sourcecopypos = 0;
 		targetcopypos = 0;
 		
 		numtargetread = 0;
+		targetmem = NULL;
+		targetmemstart = 0;
+		stats = NULL;
+		reset_cmds();
+		
+		candpos = NULL;
+		candlen = NULL;
 		
 		append((const uint8_t*)"BPS1", 4);
 		appendnum(sourcelen);
@@ -237,9 +451,12 @@ struct bps_creator {
 	}
 	
 	
-	void move_target(const uint8_t* ptr)
+	//If only part of the target is in memory, 'start' is where that part starts; the pending TargetRead
+	// must be in it.
+	void move_target(const uint8_t* ptr, size_t start = 0)
 	{
 		targetmem = ptr;
+		targetmemstart = start;
 	}
 	
 	size_t encode_delta(size_t prev, size_t next)
@@ -254,8 +471,18 @@ struct bps_creator {
 		appendnum(encode_delta(prev, next));
 	}
 	
+	void reset_cmds()
+	{
+		numcmds = 0;
+		memset(cmd_count, 0, sizeof(cmd_count));
+		memset(cmd_bytes, 0, sizeof(cmd_bytes));
+	}
+	
 	void append_cmd(bpscmd command, size_t count)
 	{
+		if (!numcmds++) firstcmd = command;
+		cmd_count[command]++;
+		cmd_bytes[command] += count;
 		appendnum((count-1)<<2 | command);
 	}
 	
@@ -263,7 +490,7 @@ struct bps_creator {
 	{
 		if (!numtargetread) return;
 		append_cmd(TargetRead, numtargetread);
-		append(targetmem+outpos-numtargetread, numtargetread);
+		append(targetmem+(outpos-numtargetread-targetmemstart), numtargetread);
 		numtargetread = 0;
 	}
 	
@@ -307,6 +534,17 @@ struct bps_creator {
 		return 1;
 	}
 	
+	//Takes back the last 'count' bytes of the pending TargetRead, so a match can start earlier.
+	void unread_target(size_t count)
+	{
+#ifdef TEST_CORRECT
+		if (count > numtargetread)
+			puts("ERROR: unreading more than was read"),abort();
+#endif
+		numtargetread -= count;
+		outpos -= count;
+	}
+	
 	
 	size_t abs_diff(size_t a, size_t b)
 	{
@@ -330,9 +568,39 @@ struct bps_creator {
 	}
 	
 	
+	bool set_optimal()
+	{
+		if (targetlen >= 0x7FFFFFFF) return false;
+		candpos = (uint32_t*)malloc(sizeof(uint32_t)*(targetlen+1));
+		candlen = (uint32_t*)malloc(sizeof(uint32_t)*(targetlen+1));
+		return (candpos && candlen);
+	}
+	
+	//Returns how many bytes match() will use for a match this long, no matter where it is or what
+	// came before it, or 1 if that depends.
+	size_t predict_taken(size_t len) const
+	{
+		if (candpos) return (len >= 64 ? len-32 : 1);
+		//use_match can't demand more than 8 bytes
+		return (len >= 8 ? len : 1);
+	}
+	
 	//Return value is how many bytes were used. If you believe the given one sucks, use TargetRead and return 1.
 	size_t match(bool is_target, size_t pos, size_t len)
 	{
+		if (candpos)
+		{
+			//the middle of a long match is rarely interesting, so only the end of it is searched again
+			size_t taken = (len >= 64 ? len-32 : 1);
+			for (size_t i=0;i<taken;i++)
+			{
+				candpos[outpos+i] = pos+i;
+				candlen[outpos+i] = (len ? len-i : 0) | (is_target ? 0x80000000 : 0);
+			}
+			outpos += taken;
+			return taken;
+		}
+		
 		if (!use_match(
 		     numtargetread,
 		     (!is_target && pos==outpos) ? 1 : // SourceRead
@@ -367,17 +635,242 @@ struct bps_creator {
 	}
 	
 	
+	void emit_greedy(const uint32_t* mycandpos, const uint32_t* mycandlen)
+	{
+		reset_cmds();
+		outpos = 0;
+		sourcecopypos = 0;
+		targetcopypos = 0;
+		while (outpos < targetlen)
+		{
+			uint32_t len = mycandlen[outpos];
+			match(len&0x80000000, mycandpos[outpos], len&0x7FFFFFFF);
+		}
+		flush_target_read();
+	}
+	
+	struct parsenode {
+		uint32_t cost; // after the path is chosen, this is the next node instead
+		uint32_t from;
+		uint32_t copypos;
+		uint32_t sourcecopypos;
+		uint32_t targetcopypos;
+		uint32_t numtargetread;
+		uint8_t cmd;
+	};
+	
+	static void relax(parsenode* nodes, size_t to, const parsenode& node)
+	{
+		if (node.cost < nodes[to].cost) nodes[to] = node;
+	}
+	
+	//'next' is the node to copy from, with 'from' and numtargetread already set.
+	void relax_copy(parsenode* nodes, parsenode next, size_t i, bool is_target, size_t pos, size_t len)
+	{
+		size_t basecost = next.cost;
+		next.cmd = (is_target ? TargetCopy : SourceCopy);
+		next.copypos = pos;
+		size_t offsetcost = num_cost(encode_delta(is_target ? next.targetcopypos : next.sourcecopypos, pos));
+		for (size_t l=1;l<=len;l++)
+		{
+			if (l > 32) l = len;
+			next.cost = basecost + num_cost((l-1)<<2) + offsetcost;
+			if (is_target) next.targetcopypos = pos+l;
+			else next.sourcecopypos = pos+l;
+			relax(nodes, (i+l)*2, next);
+		}
+	}
+	
+	//A shortest path search over the target, where each match, TargetRead and SourceRead is an edge.
+	//The cost of each edge is exact, but only the cheapest path to each position is kept, so the copy
+	// offsets are relative to that one; it's not quite optimal, but close enough. There are two nodes
+	// per position, the cheapest that ends with a TargetRead and the cheapest that doesn't, otherwise
+	// it'd break up long TargetReads for an equally expensive match and pay for another TargetRead.
+	//Truncated matches are only tried up to 32 bytes, since any longer wouldn't make the command smaller.
+	void parse_optimal(const uint8_t* source, const uint8_t* target)
+	{
+		uint32_t* mycandpos = candpos;
+		uint32_t* mycandlen = candlen;
+		candpos = NULL;
+		candlen = NULL;
+		holdflush = true;
+		
+		//the parse can be worse than the normal heuristics, since the copy offsets aren't exact, so
+		// try those too; the command list is small compared to everything else here
+		size_t start = outlen;
+		emit_greedy(mycandpos, mycandlen);
+		size_t greedylen = outlen-start;
+		
+		//node 2*n is the one at position n that doesn't end with TargetRead, 2*n+1 is the one that does
+		parsenode* nodes = (parsenode*)malloc(sizeof(parsenode)*(targetlen+1)*2);
+		if (!nodes)
+		{
+			free(mycandpos);
+			free(mycandlen);
+			holdflush = false;
+			return;
+		}
+		
+		for (size_t i=0;i<(targetlen+1)*2;i++) nodes[i].cost = 0xFFFFFFFF;
+		nodes[0].cost = 0;
+		nodes[0].sourcecopypos = 0;
+		nodes[0].targetcopypos = 0;
+		nodes[0].numtargetread = 0;
+		
+		size_t sourceread_end = 0;
+		for (size_t n=1;n<targetlen*2;n+=(n&1) ? -1 : 3)
+		{
+			//the TargetRead node goes first, so a tie keeps the longer TargetRead; a new one costs more
+			if (nodes[n].cost == 0xFFFFFFFF) continue;
+			size_t i = n/2;
+			
+			const parsenode here = nodes[n];
+			parsenode next = here;
+			next.from = n;
+			
+			next.cmd = TargetRead;
+			next.numtargetread = here.numtargetread+1;
+			if (here.numtargetread) next.cost = here.cost + 1 + num_cost(here.numtargetread<<2) - num_cost((here.numtargetread-1)<<2);
+			else next.cost = here.cost + 1 + num_cost(0);
+			relax(nodes, (i+1)*2+1, next);
+			next.numtargetread = 0;
+			
+			if (sourceread_end <= i)
+			{
+				sourceread_end = i;
+				while (sourceread_end < sourcelen && sourceread_end < targetlen &&
+				       source[sourceread_end] == target[sourceread_end]) sourceread_end++;
+			}
+			if (sourceread_end > i)
+			{
+				size_t len = sourceread_end-i;
+				next.cmd = SourceRead;
+				for (size_t l=1;l<=len;l++)
+				{
+					if (l > 32) l = len;
+					next.cost = here.cost + num_cost((l-1)<<2);
+					relax(nodes, (i+l)*2, next);
+				}
+			}
+			
+			next.cost = here.cost;
+			size_t len = mycandlen[i]&0x7FFFFFFF;
+			bool is_target = (mycandlen[i]&0x80000000);
+			size_t pos = mycandpos[i];
+			if (len && (is_target || pos != i)) relax_copy(nodes, next, i, is_target, pos, len);
+			
+			//the suffix sorter doesn't care about encoding cost, so also try to continue the previous copies
+			size_t maxlen = min(targetlen-i, (size_t)32);
+			pos = here.sourcecopypos;
+			if (pos != i && pos < sourcelen)
+			{
+				len = 0;
+				while (len < maxlen && pos+len < sourcelen && source[pos+len] == target[i+len]) len++;
+				if (len) relax_copy(nodes, next, i, false, pos, len);
+			}
+			pos = here.targetcopypos;
+			if (pos < i)
+			{
+				len = 0;
+				while (len < maxlen && target[pos+len] == target[i+len]) len++;
+				if (len) relax_copy(nodes, next, i, true, pos, len);
+			}
+		}
+		
+		size_t at = targetlen*2;
+		if (nodes[at+1].cost < nodes[at].cost) at++;
+		while (at > 1)
+		{
+			size_t from = nodes[at].from;
+			nodes[from].cost = at;
+			at = from;
+		}
+		
+		outlen = start;
+		reset_cmds();
+		outpos = 0;
+		sourcecopypos = 0;
+		targetcopypos = 0;
+		while (outpos < targetlen)
+		{
+			size_t to = nodes[at].cost;
+			size_t len = to/2-outpos;
+			at = to;
+			switch (nodes[to].cmd)
+			{
+				case SourceRead: emit_source_read(outpos, len); break;
+				case TargetRead: emit_target_read(); break;
+				case SourceCopy: emit_source_copy(nodes[to].copypos, len); break;
+				case TargetCopy: emit_target_copy(nodes[to].copypos, len); break;
+			}
+		}
+		flush_target_read();
+		free(nodes);
+		
+		if (outlen-start > greedylen)
+		{
+			outlen = start;
+			emit_greedy(mycandpos, mycandlen);
+		}
+		free(mycandpos);
+		free(mycandlen);
+		holdflush = false;
+	}
+	
 	void finish(const uint8_t* source, const uint8_t* target)
 	{
+		phasetime_clock clock = { 0, 0 };
+		if (stats) phasetime_start(&clock);
+		
+		if (candpos) parse_optimal(source, target);
 		flush_target_read();
 #ifdef TEST_CORRECT
 		if (outpos != targetlen)
 			puts("ERROR: patch creates wrong ROM size"),abort();
 #endif
+		phasetime_lap(&clock, stats ? &stats->emit : NULL);
 		
-		appendnum32(crc32(source, sourcelen));
+		appendnum32(sourcecrcknown ? sourcecrc : crc32(source, sourcelen));
 		appendnum32(crc32(target, targetlen));
-		appendnum32(crc32(out, outlen));
+		finish_patch(&clock);
+	}
+	
+	//Same as finish, for creators that don't have the files in memory, and checksum them as they're read.
+	void finish_crc(uint32_t sourcecrc, uint32_t targetcrc)
+	{
+		phasetime_clock clock = { 0, 0 };
+		if (stats) phasetime_start(&clock);
+		
+		flush_target_read();
+		phasetime_lap(&clock, stats ? &stats->emit : NULL);
+		
+		appendnum32(sourcecrcknown ? this->sourcecrc : sourcecrc);
+		appendnum32(targetcrc);
+		finish_patch(&clock);
+	}
+	
+	void finish_patch(phasetime_clock* clock)
+	{
+		uint32_t patchcrc = crc32_update(out, outlen, outcrc);
+		phasetime_lap(clock, stats ? &stats->crc : NULL);
+		
+		appendnum32(patchcrc);
+		if (sink) flush();
+		phasetime_lap(clock, stats ? &stats->emit : NULL);
+		
+		if (stats)
+		{
+			for (int i=0;i<4;i++)
+			{
+				stats->cmd_count[i] += cmd_count[i];
+				stats->cmd_bytes[i] += cmd_bytes[i];
+			}
+		}
+	}
+	
+	bool identical()
+	{
+		return (numcmds == 1 && firstcmd == SourceRead);
 	}
 	
 	struct mem getpatch()
@@ -387,7 +880,17 @@ struct bps_creator {
 		return ret;
 	}
 	
-	~bps_creator() { free(out); }
+	~bps_creator()
+	{
+		if (ctx && out)
+		{
+			ctx->out = out;
+			ctx->outbuflen = outbuflen;
+		}
+		else free(out);
+		free(candpos);
+		free(candlen);
+	}
 };
 }
 
@@ -401,8 +904,8 @@ static int match_len_tot=0;
 template<typename off_t>
 static off_t match_len(const uint8_t* a, const uint8_t* b, off_t len)
 {
-	off_t i;
-	for (i=0;i<len && a[i]==b[i];i++) {}
+	if (len <= 0) return 0;
+	off_t i = bytecmp_len(a, b, len);
 #ifdef TEST_PERF
 	match_len_n++;
 	match_len_tot+=i;
@@ -412,13 +915,14 @@ static off_t match_len(const uint8_t* a, const uint8_t* b, off_t len)
 
 //This one assumes that the longest common prefix of 'a' and 'b' is shared also by 'search'.
 //In practice, lexographically, a < search < b, which is a stronger guarantee.
+//If the length of that prefix is already known, it can be passed in as 'commonlen'.
 template<typename off_t>
 static off_t pick_best_of_two(const uint8_t* search, off_t searchlen,
                               const uint8_t* data, off_t datalen,
                               off_t a, off_t b,
-                              off_t* bestlen)
+                              off_t* bestlen, off_t commonlen = -1)
 {
-	off_t commonlen = match_len(data+a, data+b, min(datalen-a, datalen-b));
+	if (commonlen < 0) commonlen = match_len(data+a, data+b, min(datalen-a, datalen-b));
 	if (commonlen>=searchlen)
 	{
 		*bestlen=searchlen;
@@ -439,18 +943,171 @@ static off_t pick_best_of_two(const uint8_t* search, off_t searchlen,
 	}
 }
 
+//Minimums of blocks of 64 entries, minimums of 64 of those, and so on, until there's only one block
+// left. This makes it fast to skip long runs of uninteresting entries, or take the minimum of a range.
+//Entries of the original array at or above 'cap' are treated as -1.
+template<typename off_t>
+class blockmin {
+	enum { shift = 6, size = 1<<shift, maxlevels = 8 };
+	
+	const off_t* base;
+	off_t cap;
+	off_t* mem;
+	off_t* levels[maxlevels]; // levels[0] is unused, base is used instead
+	off_t lens[maxlevels];
+	int numlevels;
+	
+	off_t get(int level, off_t i) const
+	{
+		if (level) return levels[level][i];
+		return (base[i] >= cap ? -1 : base[i]);
+	}
+
+public:
+	blockmin() : mem(NULL), numlevels(0) {}
+	
+	bool init(const off_t* base, off_t len, off_t cap)
+	{
+		this->base = base;
+		this->cap = cap;
+		
+		off_t total = 0;
+		numlevels = 1;
+		lens[0] = len;
+		while (lens[numlevels-1] > size && numlevels < maxlevels)
+		{
+			lens[numlevels] = (lens[numlevels-1]+size-1) >> shift;
+			total += lens[numlevels];
+			numlevels++;
+		}
+		
+		free(mem);
+		mem = (off_t*)malloc(sizeof(off_t)*(total+1));
+		if (!mem) return false;
+		
+		off_t* at = mem;
+		for (int level=1;level<numlevels;level++)
+		{
+			levels[level] = at;
+			at += lens[level];
+			for (off_t i=0;i<lens[level];i++)
+			{
+				off_t first = i<<shift;
+				off_t last = min(first+size, lens[level-1]);
+				off_t ret = get(level-1, first);
+				for (off_t j=first+1;j<last;j++) ret = min(ret, get(level-1, j));
+				levels[level][i] = ret;
+			}
+		}
+		return true;
+	}
+	
+	//Returns the first entry at or after 'start' that's less than 'below', or len if none.
+	off_t next_below(off_t start, off_t below) const
+	{
+		off_t i = start;
+		int level = 0;
+		while (i < lens[level])
+		{
+			if (get(level, i) < below)
+			{
+				if (!level) return i;
+				level--;
+				i <<= shift;
+				continue;
+			}
+			i++;
+			if ((i & (size-1)) == 0 && level+1 < numlevels)
+			{
+				level++;
+				i >>= shift;
+			}
+		}
+		return lens[0];
+	}
+	
+	//Returns the last entry at or before 'start' that's less than 'below', or -1 if none.
+	off_t prev_below(off_t start, off_t below) const
+	{
+		off_t i = start;
+		int level = 0;
+		while (i >= 0)
+		{
+			if (get(level, i) < below)
+			{
+				if (!level) return i;
+				level--;
+				i = min((off_t)((i<<shift) + size-1), (off_t)(lens[level]-1));
+				continue;
+			}
+			if ((i & (size-1)) == 0 && level+1 < numlevels)
+			{
+				level++;
+				i = (i>>shift) - 1;
+			}
+			else i--;
+		}
+		return -1;
+	}
+	
+	//Returns the smallest entry between 'first' and 'last', inclusive.
+	off_t range_min(off_t first, off_t last) const
+	{
+		off_t ret = get(0, first);
+		int level = 0;
+		while (first <= last)
+		{
+			while (first <= last && (first & (size-1))) ret = min(ret, get(level, first++));
+			while (first <= last && ((last+1) & (size-1))) ret = min(ret, get(level, last--));
+			if (first > last) break;
+			if (level+1 == numlevels)
+			{
+				while (first <= last) ret = min(ret, get(level, first++));
+				break;
+			}
+			first >>= shift;
+			last = ((last+1) >> shift) - 1;
+			level++;
+		}
+		return ret;
+	}
+	
+	~blockmin() { free(mem); }
+};
+
 //This one takes a match, which is assumed optimal, and looks for the lexographically closest one
 // that either starts before 'maxstart', or starts at or after 'minstart'.
+//'skip' must be sorted[] with cap 'minstart'; it's used if there's a long stretch of ineligible
+// suffixes. 'lcp' is optional; if present, it's the LCP array (see create_lcp) of sorted[].
 template<typename off_t>
 static off_t adjust_match(off_t match, const uint8_t* search, off_t searchlen,
                           const uint8_t* data,off_t datalen, off_t maxstart,off_t minstart,
-                          const off_t* sorted, off_t sortedlen,
+                          const off_t* sorted, off_t sortedlen, const blockmin<off_t>& skip, const blockmin<off_t>* lcp,
                           off_t* bestlen)
 {
+	//usually, the closest eligible suffix is only a few steps away; skip is slower than that
 	off_t match_up = match;
 	off_t match_dn = match;
-	while (match_up>=0        && sorted[match_up]>=maxstart && sorted[match_up]<minstart) match_up--;
-	while (match_dn<sortedlen && sorted[match_dn]>=maxstart && sorted[match_dn]<minstart) match_dn++;
+	off_t steps = 0;
+	while (match_up>=0 && sorted[match_up]>=maxstart && sorted[match_up]<minstart)
+	{
+		match_up--;
+		if (++steps == 16)
+		{
+			match_up = skip.prev_below(match_up, maxstart);
+			break;
+		}
+	}
+	steps = 0;
+	while (match_dn<sortedlen && sorted[match_dn]>=maxstart && sorted[match_dn]<minstart)
+	{
+		match_dn++;
+		if (++steps == 16)
+		{
+			match_dn = skip.next_below(match_dn, maxstart);
+			break;
+		}
+	}
 	if (match_up<0 || match_dn>=sortedlen)
 	{
 		if (match_up<0 && match_dn>=sortedlen)
@@ -463,7 +1120,8 @@ static off_t adjust_match(off_t match, const uint8_t* search, off_t searchlen,
 		return pos;
 	}
 	
-	return pick_best_of_two(search,searchlen, data,datalen, sorted[match_up],sorted[match_dn], bestlen);
+	off_t commonlen = (lcp ? lcp->range_min(match_up+1, match_dn) : -1);
+	return pick_best_of_two(search,searchlen, data,datalen, sorted[match_up],sorted[match_dn], bestlen, commonlen);
 }
 
 
@@ -485,50 +1143,82 @@ static uint16_t read2(const uint8_t* data, off_t len)
 	}
 }
 
+//Unlike find_index, 'search' doesn't need to be in the index; this one finds where it would be
+// inserted, and returns the best of the two suffixes next to that spot.
+//'lcp' is optional; if present, lcp[i] is the common prefix length of index[i-1] and index[i].
 template<typename off_t>
-static void create_buckets(const uint8_t* data, off_t* index, off_t len, off_t* buckets)
+static off_t find_closest(const uint8_t* search, off_t searchlen,
+                          const uint8_t* data, off_t datalen, const off_t* index, const off_t* buckets,
+                          const off_t* lcp, off_t* bestlen)
 {
-	off_t low = 0;
-	off_t high;
+	if (!datalen)
+	{
+		*bestlen=0;
+		return 0;
+	}
 	
-	for (int n=0;n<65536;n++)
+	uint16_t bucket = read2(search, searchlen);
+	
+	//everything below 'low' is smaller than 'search', everything at or above 'high' is not
+	off_t low = buckets[bucket];
+	off_t high = buckets[bucket+1];
+	
+	off_t lowmatch = 0;
+	off_t highmatch = 0;
+	
+	while (low < high)
 	{
-		//'low' remains from the previous iteration and is a known minimum
-		high = low+(len/131072)+1; // optimal value: slightly above a third of the distance to the next one
-		while (true)
-		{
-			if (high > len-1) break;
-			
-			off_t pos = index[high];
-			uint16_t here = read2(data+pos, len-pos);
-			
-			if (here >= n) break;
-			else
-			{
-				off_t diff = high-low;
-				low = high;
-				high = high+diff*2;
-			}
-		}
-		if (high > len-1) high = len-1;
+		off_t mid = low + (high-low)/2;
+		off_t midpos = index[mid];
 		
+		off_t len = min(searchlen, datalen-midpos);
+		off_t matchlen = min(lowmatch, highmatch);
+		matchlen += match_len(search+matchlen, data+midpos+matchlen, len-matchlen);
+		
+		bool less;
+		if (matchlen < len) less = (data[midpos+matchlen] < search[matchlen]);
+		else less = (datalen-midpos < searchlen) ^ EOF_IS_LAST;
 		
-		while (low < high)
+		if (less)
 		{
-			off_t mid = low + (high-low)/2;
-			off_t midpos = index[mid];
-			
-			uint16_t here = read2(data+midpos, len-midpos);
-			if (here < n) low = mid+1;
-			else high = mid;
+			low = mid+1;
+			lowmatch = matchlen;
 		}
-		buckets[n] = low;
+		else
+		{
+			high = mid;
+			highmatch = matchlen;
+		}
+	}
+	
+	if (low == 0 || low == datalen)
+	{
+		off_t pos = index[low == 0 ? 0 : datalen-1];
+		*bestlen = match_len(search, data+pos, min(searchlen, datalen-pos));
+		return pos;
 	}
+	return pick_best_of_two(search,searchlen, data,datalen, index[low-1],index[low], bestlen, lcp ? lcp[low] : -1);
+}
+
+
+
+//'index' must be the entire suffix array of 'data'; it's only used for validation. Since the buckets
+// are sorted by their first two bytes, and every suffix is in the index, the bucket starts are just a
+// running total of how many suffixes start with each byte pair.
+template<typename off_t>
+static void create_buckets(const uint8_t* data, const off_t* index, off_t len, off_t* buckets)
+{
+	for (int n=0;n<=65536;n++) buckets[n] = 0;
+	
+	//count into the next bucket, so the running total gives the starts directly
+	for (off_t i=0;i+1<len;i++) buckets[read2_uc(data+i)+1]++;
+	//the last suffix is only one byte
+	if (len) buckets[read2(data+len-1, (off_t)1)+1]++;
 	
-	buckets[65536] = len;
+	for (int n=1;n<=65536;n++) buckets[n] += buckets[n-1];
 	
 #ifdef TEST_CORRECT
-	if (buckets[0]!=0)
+	if (buckets[0]!=0 || buckets[65536]!=len)
 	{
 		printf("e: buckets suck, [0]=%i\n", buckets[0]);
 		abort();
@@ -547,6 +1237,8 @@ static void create_buckets(const uint8_t* data, off_t* index, off_t len, off_t*
 		}
 		//printf("%i:[%i]%i\n",n,low,read2(data+index[low],len-low));
 	}
+#else
+	(void)index;
 #endif
 }
 
@@ -592,12 +1284,10 @@ static off_t find_index(off_t pos, const uint8_t* data, off_t datalen, const off
 		const uint8_t* search = data+pos+matchlenstart;
 		const uint8_t* here = data+midpos+matchlenstart;
 		
-		while (len>0 && *search==*here)
-		{
-			search++;
-			here++;
-			len--;
-		}
+		off_t common = match_len(search, here, len);
+		search += common;
+		here += common;
+		len -= common;
 		
 		off_t matchlen = search-data-pos;
 		
@@ -630,7 +1320,7 @@ static off_t find_index(off_t pos, const uint8_t* data, off_t datalen, const off
 
 
 template<typename off_t>
-static void create_reverse_index(off_t* index, off_t* reverse, off_t len)
+static void create_reverse_index(const off_t* index, off_t* reverse, off_t len)
 {
 //testcase: linux 3.18.14 -> 4.0.4 .xz
 //without: real23.544 user32.930
@@ -641,6 +1331,38 @@ static void create_reverse_index(off_t* index, off_t* reverse, off_t len)
 	for (off_t i=0;i<len;i++) reverse[index[i]]=i;
 }
 
+//Kasai et al's algorithm. lcp[i] is the length of the common prefix of index[i-1] and index[i]; lcp[0] is 0.
+//'rank' is the output of create_reverse_index.
+template<typename off_t>
+static void create_lcp(const uint8_t* data, const off_t* index, const off_t* rank, off_t len, off_t* lcp)
+{
+	off_t common = 0;
+	for (off_t i=0;i<len;i++)
+	{
+		if (rank[i] == 0)
+		{
+			lcp[0] = 0;
+			common = 0;
+			continue;
+		}
+		off_t prev = index[rank[i]-1];
+		while (i+common<len && prev+common<len && data[i+common]==data[prev+common]) common++;
+		lcp[rank[i]] = common;
+		if (common) common--;
+	}
+}
+
+template<typename off_t>
+static bool create_lcp(const uint8_t* data, const off_t* index, off_t len, off_t* lcp)
+{
+	off_t* rank = (off_t*)malloc(sizeof(off_t)*len);
+	if (!rank) return false;
+	create_reverse_index(index, rank, len);
+	create_lcp(data, index, (const off_t*)rank, len, lcp);
+	free(rank);
+	return true;
+}
+
 template<typename off_t>
 static off_t nextsize(off_t outpos, off_t sortedsize, off_t targetlen)
 {
@@ -655,8 +1377,95 @@ off_t lerp(off_t x, off_t y, float frac)
 	return x + (y-x)*frac;
 }
 
+//Everything needed to find the best match for a target position, with the current index. It's all
+// read only, so several threads can search at once.
+template<typename off_t>
+struct suf_search {
+	const uint8_t* data; // mem_joined
+	off_t sortedsize;
+	off_t sourcelen;
+	
+	const off_t* sorted;
+	off_t indexlen;
+	const off_t* sorted_inverse;
+	off_t* buckets;
+	const blockmin<off_t>* skip;
+	const blockmin<off_t>* lcp;
+	
+	const off_t* srcsorted;
+	const off_t* srcbuckets;
+	const off_t* srclcp;
+	
+	//Returns the match position in data[]; if it's at or after sortedsize, it's in the source.
+	off_t find(off_t outpos, off_t* matchlen) const
+	{
+		off_t matchpos = adjust_match(find_index(outpos, data, indexlen, sorted, sorted_inverse, buckets),
+		                              data+outpos, sortedsize-outpos,
+		                              data,indexlen, outpos,sortedsize,
+		                              sorted, indexlen, *skip, lcp,
+		                              matchlen);
+		
+		if (srcsorted)
+		{
+			off_t srcmatchlen;
+			off_t srcmatchpos = find_closest(data+outpos, sortedsize-outpos,
+			                                 data+sortedsize, sourcelen, srcsorted, srcbuckets, srclcp,
+			                                 &srcmatchlen);
+			if (srcmatchlen >= *matchlen)
+			{
+				matchpos = sortedsize+srcmatchpos;
+				*matchlen = srcmatchlen;
+			}
+		}
+		return matchpos;
+	}
+};
+
+//Searches 'threads' equally big pieces of start..end at once. Each thread follows the matches it
+// finds the same way bps_creator would, as far as it can tell, and stores them in matchpos/matchlen,
+// relative to start; positions it skips over are set to -1.
+//Usually, the creator only hits skipped positions right after crossing into the next piece.
+template<typename off_t>
+static void search_pieces(const suf_search<off_t>& search, const struct bps_creator * out, int threads,
+                          off_t start, off_t end, off_t* matchpos, off_t* matchlen)
+{
+	for (off_t i=0;i<end-start;i++) matchlen[i] = -1;
+	off_t piecelen = (end-start+threads-1)/threads;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (int t=0;t<threads;t++)
+	{
+		off_t pos = start + piecelen*t;
+		off_t pieceend = min(pos+piecelen, end);
+		while (pos < pieceend)
+		{
+			matchpos[pos-start] = search.find(pos, &matchlen[pos-start]);
+			pos += out->predict_taken(matchlen[pos-start]);
+		}
+	}
+}
+
+//bps_index_create returns this, followed by the suffix array of the source, then the bucket and LCP
+// arrays if the flags say they're there. It's all in native byte order; an index from a machine with
+// other endianness fails the version check. 'datacrc' is the CRC32 of everything after the header.
+struct bps_index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t sourcelen;
+	uint32_t sourcecrc;
+	uint32_t offsize;
+	uint32_t datacrc;
+	uint32_t unused; // zero
+};
+static const char bps_index_magic[8] = { 'B','P','S','I','N','D','E','X' };
+enum { bps_index_version = 2 };
+enum { bps_index_buckets = 1, bps_index_lcp = 2 };
+
 template<typename off_t>
-static bpserror bps_create_suf_core(file* source, file* target, bool moremem, struct bps_creator * out)
+static bpserror bps_create_suf_core(file* source, file* target, bool moremem, const bps_index_header* index,
+                                    struct bps_creator * out, bps_delta_ctx* ctx)
 {
 #define error(which) do { err = which; goto error; } while(0)
 	bpserror err;
@@ -684,25 +1493,73 @@ static bpserror bps_create_suf_core(file* source, file* target, bool moremem, st
 	off_t sourcelen = realsourcelen;
 	off_t targetlen = realtargetlen;
 	
-	uint8_t* mem_joined = (uint8_t*)malloc(sizeof(uint8_t)*(realsourcelen+realtargetlen));
+	//with a source index, only the target is sorted here
+	size_t sortedlen = (index ? realtargetlen : realsourcelen+realtargetlen);
+	
+	size_t joinedsize = sizeof(uint8_t)*(realsourcelen+realtargetlen);
+	size_t sortedbytes = sizeof(off_t)*sortedlen;
+	
+	//the search and the emitter take turns for each match, so the emitter is timed by wall clock
+	// only, and the search is whatever's left of the loop
+	bps_stats* stats = out->stats;
+	phasetime_clock clock = { 0, 0 };
+	phase_time looptime = { 0, 0 };
+	double emitwall = 0;
+	if (stats) phasetime_start(&clock);
+	
+	uint8_t* mem_joined = (uint8_t*)ctx_malloc(ctx, &bps_delta_ctx::joined, joinedsize);
 	
-	off_t* sorted = (off_t*)malloc(sizeof(off_t)*(realsourcelen+realtargetlen));
+	off_t* sorted = (off_t*)ctx_malloc(ctx, &bps_delta_ctx::sorted, sortedbytes);
 	
 	off_t* sorted_inverse = NULL;
-	if (moremem) sorted_inverse = (off_t*)malloc(sizeof(off_t)*(realsourcelen+realtargetlen));
+	if (moremem) sorted_inverse = (off_t*)ctx_malloc(ctx, &bps_delta_ctx::sorted_inverse, sortedbytes);
+	
+	//the reverse index is also what the LCP array needs, so it's only used with moremem
+	off_t* lcp = NULL;
+	if (moremem && USE_LCP) lcp = (off_t*)ctx_malloc(ctx, &bps_delta_ctx::lcp, sortedbytes);
 	
 	off_t* buckets = NULL;
-	if (!sorted_inverse) buckets = (off_t*)malloc(sizeof(off_t)*65537);
+	if (!sorted_inverse) buckets = (off_t*)ctx_malloc(ctx, &bps_delta_ctx::buckets, sizeof(off_t)*65537);
 	
-	if (!sorted || !mem_joined || (!sorted_inverse && !buckets))
+	if (!sorted || !mem_joined || (!sorted_inverse && !buckets) || (moremem && USE_LCP && !lcp))
 	{
-		free(mem_joined);
-		free(sorted);
-		free(sorted_inverse);
-		free(buckets);
+		ctx_free(ctx, mem_joined, joinedsize);
+		ctx_free(ctx, sorted, sortedbytes);
+		ctx_free(ctx, sorted_inverse, sortedbytes);
+		ctx_free(ctx, lcp, sortedbytes);
+		ctx_free(ctx, buckets, sizeof(off_t)*65537);
 		return bps_out_of_mem;
 	}
 	
+	blockmin<off_t> skip;
+	blockmin<off_t> lcpmin;
+	suf_search<off_t> search;
+	
+	//with more than one thread, the search runs ahead of the creator in pieces of this size per thread
+#ifdef _OPENMP
+	int threads = omp_get_max_threads();
+#else
+	int threads = 1;
+#endif
+	const off_t piecesize = 65536;
+	off_t chunkstart = 0;
+	off_t chunkend = 0;
+	size_t chunkbytes = sizeof(off_t)*piecesize*threads;
+	off_t* chunkpos = NULL;
+	off_t* chunklen = NULL;
+	if (threads > 1 && targetlen > piecesize)
+	{
+		chunkpos = (off_t*)ctx_malloc(ctx, &bps_delta_ctx::chunkpos, chunkbytes);
+		chunklen = (off_t*)ctx_malloc(ctx, &bps_delta_ctx::chunklen, chunkbytes);
+		if (!chunkpos || !chunklen)
+		{
+			ctx_free(ctx, chunkpos, chunkbytes);
+			ctx_free(ctx, chunklen, chunkbytes);
+			chunkpos = NULL;
+			chunklen = NULL;
+		}
+	}
+	
 	//sortedsize is how much of the target file is sorted
 	off_t sortedsize = targetlen;
 	//divide by 4 for each iteration, to avoid sorting 50% of the file (the sorter is slow)
@@ -711,6 +1568,29 @@ static bpserror bps_create_suf_core(file* source, file* target, bool moremem, st
 	off_t prevsortedsize = 0;
 	off_t outpos = 0;
 	
+	//once the target is re-sorted, the source gets its own index, at the end of sorted[]; or it's
+	// given from the start
+	const off_t* srcsorted = NULL;
+	const off_t* srcbuckets = NULL;
+	const off_t* srclcp = NULL;
+	off_t* srcbuckets_mem = NULL;
+	
+	if (index)
+	{
+		const uint8_t* at = (const uint8_t*)(index+1);
+		srcsorted = (const off_t*)at;
+		at += sizeof(off_t)*sourcelen;
+		if (index->flags & bps_index_buckets)
+		{
+			srcbuckets = (const off_t*)at;
+			at += sizeof(off_t)*65537;
+		}
+		if (index->flags & bps_index_lcp) srclcp = (const off_t*)at;
+	}
+	
+	//how much of mem_joined is in sorted[]; either the target prefix and source, or only the target prefix
+	off_t indexlen;
+	
 	goto reindex; // jump into the middle so I won't need a special case to enter it
 	
 	while (outpos < targetlen)
@@ -721,6 +1601,8 @@ static bpserror bps_create_suf_core(file* source, file* target, bool moremem, st
 			
 		reindex:
 			
+			phasetime_lap(&clock, stats ? (prevsortedsize ? &looptime : &stats->alloc) : NULL);
+			
 			//this isn't an exact science
 			const float percSort = sorted_inverse ? 0.67 : 0.50;
 			const float percInv = sorted_inverse ? 0.11 : 0.10;
@@ -730,56 +1612,157 @@ static bpserror bps_create_suf_core(file* source, file* target, bool moremem, st
 			const size_t progPreInv = lerp(prevsortedsize, sortedsize, percSort);
 			const size_t progPreFind = lerp(prevsortedsize, sortedsize, percSort+percInv);
 			
-			prevsortedsize = sortedsize;
-			
 			if (!out->progress(progPreSort, targetlen)) error(bps_canceled);
 			
-			if (!target->read(mem_joined, 0, sortedsize)) error(bps_io);
-			if (!source->read(mem_joined+sortedsize, 0, sourcelen)) error(bps_io);
+			//the source suffixes are in the same order with or without a target in front of them, so
+			// instead of sorting the source again, take them out of the old array and only sort the target
+			bool firstpass = (prevsortedsize == 0);
+			if (!firstpass && !srcsorted && sourcelen)
+			{
+				//moving backwards from the end can't overwrite anything not yet moved, since
+				// targetlen > prevsortedsize
+				off_t* newsrcsorted = sorted+targetlen;
+				off_t at = sourcelen;
+				for (off_t i=prevsortedsize+sourcelen-1;i>=0;i--)
+				{
+					if (sorted[i] >= prevsortedsize) newsrcsorted[--at] = sorted[i]-prevsortedsize;
+				}
+				srcsorted = newsrcsorted;
+			}
+			if (srcsorted && !srcbuckets && !srcbuckets_mem)
+			{
+				srcbuckets_mem = (off_t*)ctx_malloc(ctx, &bps_delta_ctx::srcbuckets, sizeof(off_t)*65537);
+				if (!srcbuckets_mem) error(bps_out_of_mem);
+			}
+			
+			off_t oldsortedsize = prevsortedsize;
+			prevsortedsize = sortedsize;
+			indexlen = (srcsorted ? sortedsize : sortedsize+sourcelen);
+			phasetime_lap(&clock, stats ? &stats->index : NULL);
+			
+			//the source follows the sorted part of the target; when that grows, move the source up and
+			// only read the new part of the target, rather than reading everything again
+			if (firstpass)
+			{
+				if (!target->read(mem_joined, 0, sortedsize)) error(bps_io);
+				if (!source->read(mem_joined+sortedsize, 0, sourcelen)) error(bps_io);
+			}
+			else
+			{
+				memmove(mem_joined+sortedsize, mem_joined+oldsortedsize, sourcelen);
+				if (!target->read(mem_joined+oldsortedsize, oldsortedsize, sortedsize-oldsortedsize)) error(bps_io);
+			}
+			phasetime_lap(&clock, stats ? &stats->read : NULL);
+			if (index && firstpass)
+			{
+				uint32_t sourcecrc;
+				if (!source->known_crc32(&sourcecrc)) sourcecrc = crc32(mem_joined+sortedsize, sourcelen);
+				if (sourcecrc != index->sourcecrc) error(bps_wrong_index);
+			}
+			phasetime_lap(&clock, stats ? &stats->crc : NULL);
 			out->move_target(mem_joined);
-			sufsort(sorted, mem_joined, sortedsize+sourcelen);
+			sufsort(sorted, mem_joined, indexlen);
+			phasetime_lap(&clock, stats ? &stats->sort : NULL);
 			
 			if (!out->progress(progPreInv, targetlen)) error(bps_canceled);
 			
+			if (srcsorted && !srcbuckets)
+			{
+				create_buckets(mem_joined+sortedsize, srcsorted, sourcelen, srcbuckets_mem);
+				srcbuckets = srcbuckets_mem;
+			}
 			if (sorted_inverse)
-				create_reverse_index(sorted, sorted_inverse, sortedsize+sourcelen);
+			{
+				create_reverse_index(sorted, sorted_inverse, indexlen);
+				if (lcp)
+				{
+					create_lcp(mem_joined, (const off_t*)sorted, (const off_t*)sorted_inverse, indexlen, lcp);
+					if (!lcpmin.init(lcp, indexlen, indexlen)) error(bps_out_of_mem);
+				}
+			}
 			else
-				create_buckets(mem_joined, sorted, sortedsize+sourcelen, buckets);
+				create_buckets(mem_joined, sorted, indexlen, buckets);
+			if (!skip.init(sorted, indexlen, sortedsize)) error(bps_out_of_mem);
+			phasetime_lap(&clock, stats ? &stats->index : NULL);
+			
+			search.data = mem_joined;
+			search.sortedsize = sortedsize;
+			search.sourcelen = sourcelen;
+			search.sorted = sorted;
+			search.indexlen = indexlen;
+			search.sorted_inverse = sorted_inverse;
+			search.buckets = buckets;
+			search.skip = &skip;
+			search.lcp = (lcp ? &lcpmin : NULL);
+			search.srcsorted = srcsorted;
+			search.srcbuckets = srcbuckets;
+			search.srclcp = srclcp;
+			chunkend = 0; // the old results are from the old index
 			
 			if (!out->progress(progPreFind, targetlen)) error(bps_canceled);
 		}
 		
-		off_t matchlen = 0;
-		off_t matchpos = adjust_match(find_index(outpos, mem_joined, sortedsize+sourcelen, sorted, sorted_inverse, buckets),
-		                              mem_joined+outpos, sortedsize-outpos,
-		                              mem_joined,sortedsize+sourcelen, outpos,sortedsize,
-		                              sorted, sortedsize+sourcelen,
-		                              &matchlen);
+		//the goto above skips the loop condition; an empty target has nothing to search for (and,
+		// with a source index, an empty sorted[] to search in)
+		if (outpos >= targetlen) break;
+		
+		if (chunkpos && (outpos < chunkstart || outpos >= chunkend))
+		{
+			//the search must stay before the point where it's reindexed
+			off_t searchend = (sortedsize < targetlen ? sortedsize-256 : targetlen);
+			chunkstart = outpos;
+			chunkend = min(outpos+piecesize*threads, searchend);
+			search_pieces(search, out, threads, chunkstart, chunkend, chunkpos, chunklen);
+		}
+		
+		off_t matchlen;
+		off_t matchpos;
+		if (chunkpos && outpos < chunkend && chunklen[outpos-chunkstart] >= 0)
+		{
+			matchpos = chunkpos[outpos-chunkstart];
+			matchlen = chunklen[outpos-chunkstart];
+		}
+		else matchpos = search.find(outpos, &matchlen);
 		
 #ifdef TEST_CORRECT
 		if (matchlen && matchpos >= outpos && matchpos < sortedsize) puts("ERROR: found match in invalid location"),abort();
 		if (memcmp(mem_joined+matchpos, mem_joined+outpos, matchlen)) puts("ERROR: found match doesn't match"),abort();
 #endif
 		
+		double emitstart = (stats ? phasetime_wall() : 0);
 		off_t taken;
 		if (matchpos >= sortedsize) taken = out->match(false, matchpos-sortedsize, matchlen);
 		else taken = out->match(true, matchpos, matchlen);
+		if (stats) emitwall += phasetime_wall()-emitstart;
 #ifdef TEST_CORRECT
 		if (taken < 0) puts("ERROR: match() returned negative"),abort();
-		if (matchlen >= 7 && taken < matchlen) printf("ERROR: match() took %i bytes, offered %i\n", taken, matchlen),abort();
+		//the optimal parser only records candidates, and takes less on purpose
+		if (!out->candpos && matchlen >= 7 && taken < matchlen) printf("ERROR: match() took %i bytes, offered %i\n", taken, matchlen),abort();
 #endif
 		outpos += taken;
 	}
 	
+	phasetime_lap(&clock, stats ? &looptime : NULL);
 	out->finish(mem_joined+sortedsize, mem_joined);
 	
 	err = bps_ok;
 	
 error:
-	free(buckets);
-	free(sorted_inverse);
-	free(sorted);
-	free(mem_joined);
+	if (stats)
+	{
+		stats->search.wall += looptime.wall - emitwall;
+		stats->search.cpu += looptime.cpu - emitwall;
+		stats->emit.wall += emitwall;
+		stats->emit.cpu += emitwall;
+	}
+	ctx_free(ctx, chunkpos, chunkbytes);
+	ctx_free(ctx, chunklen, chunkbytes);
+	ctx_free(ctx, srcbuckets_mem, sizeof(off_t)*65537);
+	ctx_free(ctx, buckets, sizeof(off_t)*65537);
+	ctx_free(ctx, lcp, sortedbytes);
+	ctx_free(ctx, sorted_inverse, sortedbytes);
+	ctx_free(ctx, sorted, sortedbytes);
+	ctx_free(ctx, mem_joined, joinedsize);
 	
 	return err;
 }
@@ -797,27 +1780,634 @@ error:
 //	return err;
 //}
 
+//If the creator has no sink, the patch goes to 'patchmem'.
+static bpserror bps_getpatch(struct bps_creator * bps, struct mem * patchmem)
+{
+	if (!bps->sinkok) return bps_write_failed;
+	if (!bps->sink) *patchmem = bps->getpatch();
+	
+	if (bps->identical()) return bps_identical;
+	return bps_ok;
+}
+
 //This one picks a function based on 32-bit integers if that fits. This halves memory use for common inputs.
 //It also handles some stuff related to the BPS headers and footers.
-bpserror bps_create_delta(file* source, file* target, struct mem metadata, struct mem * patchmem,
-                          bool (*progress)(void* userdata, size_t done, size_t total), void* userdata, bool moremem)
+//The patch goes to 'patchfile' if it's not NULL, otherwise 'patchmem'.
+static bpserror bps_create_delta_main(file* source, file* target, struct mem metadata,
+                                      struct mem * patchmem, filewrite* patchfile,
+                                      bool (*progress)(void* userdata, size_t done, size_t total), void* userdata,
+                                      bool moremem, const bps_index_header* index, bool optimal, bps_delta_ctx* ctx,
+                                      bps_stats* stats)
 {
-	bps_creator bps(source, target, metadata);
+	bps_creator bps(source, target, metadata, patchfile, ctx);
+	bps.stats = stats;
 	bps.setProgress(progress, userdata);
-	
-	size_t maindata = bps.outlen;
+	if (optimal && !bps.set_optimal()) return (target->len() >= 0x7FFFFFFF ? bps_too_big : bps_out_of_mem);
 	
 	//off_t must be signed
-	bpserror err = bps_create_suf_core<int32_t>(source, target, moremem, &bps);
+	bpserror err = bps_create_suf_core<int32_t>(source, target, moremem, index, &bps, ctx);
 	if (err!=bps_ok) return err;
 	
-	*patchmem = bps.getpatch();
+	return bps_getpatch(&bps, patchmem);
+}
+
+bpserror bps_create_delta(file* source, file* target, struct mem metadata, struct mem * patchmem,
+                          bool (*progress)(void* userdata, size_t done, size_t total), void* userdata, bool moremem)
+{
+	return bps_create_delta_main(source, target, metadata, patchmem, NULL, progress, userdata, moremem, NULL, false, NULL, NULL);
+}
+
+bpserror bps_create_delta_file(file* source, file* target, struct mem metadata, filewrite* patch,
+                               bool (*progress)(void* userdata, size_t done, size_t total), void* userdata, bool moremem)
+{
+	return bps_create_delta_main(source, target, metadata, NULL, patch, progress, userdata, moremem, NULL, false, NULL, NULL);
+}
+
+bpserror bps_create_optimal(file* source, file* target, struct mem metadata, struct mem * patchmem,
+                            bool (*progress)(void* userdata, size_t done, size_t total), void* userdata, bool moremem)
+{
+	return bps_create_delta_main(source, target, metadata, patchmem, NULL, progress, userdata, moremem, NULL, true, NULL, NULL);
+}
+
+bpserror bps_create_optimal_file(file* source, file* target, struct mem metadata, filewrite* patch,
+                                 bool (*progress)(void* userdata, size_t done, size_t total), void* userdata, bool moremem)
+{
+	return bps_create_delta_main(source, target, metadata, NULL, patch, progress, userdata, moremem, NULL, true, NULL, NULL);
+}
+
+enum bpserror bps_index_create(file* source, bool lcp, struct mem * index)
+{
+	index->ptr = NULL;
+	index->len = 0;
+	
+	size_t len = source->len();
+	if ((size_t)(int32_t)len != len || (int32_t)len < 0) return bps_too_big;
+	if (len >= SIZE_MAX/sizeof(int32_t)/2 - 65537) return bps_too_big;
+	
+	size_t outlen = bps_index_memory(len, lcp);
+	uint8_t* out = (uint8_t*)malloc(outlen);
+	uint8_t* data = (uint8_t*)malloc(len);
+	if (!out || !data)
+	{
+		free(out);
+		free(data);
+		return bps_out_of_mem;
+	}
+	if (!source->read(data, 0, len))
+	{
+		free(out);
+		free(data);
+		return bps_io;
+	}
+	
+	bps_index_header* head = (bps_index_header*)out;
+	memcpy(head->magic, bps_index_magic, sizeof(head->magic));
+	head->version = bps_index_version;
+	head->flags = bps_index_buckets | (lcp ? bps_index_lcp : 0);
+	head->sourcelen = len;
+	if (!source->known_crc32(&head->sourcecrc)) head->sourcecrc = crc32(data, len);
+	head->offsize = sizeof(int32_t);
+	head->unused = 0;
+	
+	int32_t* sorted = (int32_t*)(head+1);
+	int32_t* buckets = sorted+len;
+	sufsort(sorted, data, (int32_t)len);
+	create_buckets(data, sorted, (int32_t)len, buckets);
+	if (lcp && !create_lcp(data, (const int32_t*)sorted, (int32_t)len, buckets+65537))
+	{
+		free(out);
+		free(data);
+		return bps_out_of_mem;
+	}
+	
+	free(data);
+	head->datacrc = crc32((uint8_t*)(head+1), outlen-sizeof(bps_index_header));
+	index->ptr = out;
+	index->len = outlen;
+	return bps_ok;
+}
+
+size_t bps_index_memory(size_t sourcelen, bool lcp)
+{
+	return sizeof(bps_index_header) + sizeof(int32_t)*(sourcelen + 65537 + (lcp ? sourcelen : 0));
+}
+
+//The search uses everything in the index as offsets and lengths without looking, so an index from a
+// file that's damaged, or made by something else, could make it read anywhere. The checksum finds the
+// former; the rest makes sure nothing points outside the source, whether the checksum matches or not.
+static bpserror bps_index_check(struct mem index, size_t sourcelen)
+{
+	const bps_index_header* head = (const bps_index_header*)index.ptr;
+	if (index.len < sizeof(bps_index_header)) return bps_wrong_index;
+	if (memcmp(head->magic, bps_index_magic, sizeof(head->magic)) != 0) return bps_wrong_index;
+	if (head->version != bps_index_version || head->offsize != sizeof(int32_t)) return bps_wrong_index;
+	
+	if (head->sourcelen != sourcelen) return bps_wrong_index;
+	if ((size_t)(int32_t)sourcelen != sourcelen || (int32_t)sourcelen < 0) return bps_wrong_index;
+	
+	size_t arrays = sourcelen;
+	if (head->flags & bps_index_buckets) arrays += 65537;
+	if (head->flags & bps_index_lcp) arrays += sourcelen;
+	if (index.len != sizeof(bps_index_header) + sizeof(int32_t)*arrays) return bps_wrong_index;
+	
+	const int32_t* sorted = (const int32_t*)(head+1);
+	if (crc32((const uint8_t*)sorted, sizeof(int32_t)*arrays) != head->datacrc) return bps_wrong_index;
+	
+	int32_t len = (int32_t)sourcelen;
+	const int32_t* next = sorted+len;
+	for (int32_t i=0;i<len;i++)
+	{
+		if (sorted[i] < 0 || sorted[i] >= len) return bps_wrong_index;
+	}
+	if (head->flags & bps_index_buckets)
+	{
+		const int32_t* buckets = next;
+		if (buckets[0] != 0 || buckets[65536] != len) return bps_wrong_index;
+		for (int n=0;n<65536;n++)
+		{
+			if (buckets[n] > buckets[n+1]) return bps_wrong_index;
+		}
+		next += 65537;
+	}
+	if (head->flags & bps_index_lcp)
+	{
+		//lcp[i] is shared by sorted[i-1] and sorted[i], so it can't go past the end of either
+		const int32_t* lcp = next;
+		if (len && lcp[0] != 0) return bps_wrong_index;
+		for (int32_t i=1;i<len;i++)
+		{
+			if (lcp[i] < 0 || lcp[i] > len-sorted[i-1] || lcp[i] > len-sorted[i]) return bps_wrong_index;
+		}
+	}
+	return bps_ok;
+}
+
+static bpserror bps_create_indexed_main(file* source, struct mem index, file* target, struct mem metadata,
+                                        struct mem * patchmem, filewrite* patchfile,
+                                        bool (*progress)(void* userdata, size_t done, size_t total), void* userdata,
+                                        bool moremem, bps_delta_ctx* ctx, bps_stats* stats)
+{
+	const bps_index_header* head = (const bps_index_header*)index.ptr;
+	size_t sourcelen = source->len();
+	if (sourcelen >= SIZE_MAX/sizeof(int32_t)/2 - 65537) return bps_too_big;
+	
+	//checking it reads the entire index, so with a context, it's only done for the first patch
+	if (!ctx || ctx->checkedindex != index.ptr || ctx->checkedindexlen != index.len)
+	{
+		bpserror err = bps_index_check(index, sourcelen);
+		if (err != bps_ok) return err;
+		if (ctx)
+		{
+			ctx->checkedindex = index.ptr;
+			ctx->checkedindexlen = index.len;
+		}
+	}
+	
+	return bps_create_delta_main(source, target, metadata, patchmem, patchfile, progress, userdata, moremem, head, false, ctx, stats);
+}
+
+enum bpserror bps_create_delta_indexed(file* source, struct mem index, file* target, struct mem metadata, struct mem * patch,
+                                       bool (*progress)(void* userdata, size_t done, size_t total), void* userdata,
+                                       bool moremem)
+{
+	return bps_create_indexed_main(source, index, target, metadata, patch, NULL, progress, userdata, moremem, NULL, NULL);
+}
+
+enum bpserror bps_create_delta_indexed_file(file* source, struct mem index, file* target, struct mem metadata, filewrite* patch,
+                                            bool (*progress)(void* userdata, size_t done, size_t total), void* userdata,
+                                            bool moremem)
+{
+	return bps_create_indexed_main(source, index, target, metadata, NULL, patch, progress, userdata, moremem, NULL, NULL);
+}
+
+enum bpserror bps_create_delta_ctx(struct bps_delta_ctx* ctx, file* source, struct mem index, file* target, struct mem metadata,
+                                   struct mem * patch, filewrite* patchfile,
+                                   bool (*progress)(void* userdata, size_t done, size_t total), void* userdata,
+                                   bool moremem, struct bps_stats * stats)
+{
+	if (index.ptr) return bps_create_indexed_main(source, index, target, metadata, patch, patchfile, progress, userdata, moremem, ctx, stats);
+	return bps_create_delta_main(source, target, metadata, patch, patchfile, progress, userdata, moremem, NULL, false, ctx, stats);
+}
+
+
+//The hash creator only indexes every hash_block bytes of the inputs, so it only finds matches at
+// least this long; it's guaranteed to find those at least twice as long, if they're in the table.
+static const size_t hash_block = 16;
+static const uint32_t hash_mul = 0x01000193; // FNV prime, but any odd number not too close to a power of two works
+static const size_t hash_min_entries = 1024;
+
+static uint32_t hash_init(const uint8_t* data)
+{
+	uint32_t h = 0;
+	for (size_t i=0;i<hash_block;i++) h = h*hash_mul + data[i];
+	return h;
+}
+
+static unsigned hash_table_bits(size_t sourcelen, size_t targetlen, size_t tablesize)
+{
+	//by default, make room for every block, but don't go above 64MB; there are diminishing returns
+	size_t blocks = (sourcelen+targetlen)/hash_block;
+	if (!tablesize) tablesize = min(blocks*sizeof(size_t), (size_t)64*1024*1024);
+	unsigned bits = 0;
+	while (bits < 30 && ((size_t)2<<bits)*sizeof(size_t) <= tablesize && ((size_t)1<<bits) < blocks) bits++;
+	while (((size_t)1<<bits) < hash_min_entries) bits++;
+	return bits;
+}
+
+static size_t hash_slot(uint32_t h, unsigned bits)
+{
+	//the low bits of the rolling hash are poor; this mixes them in
+	return (uint32_t)(h*0x9E3779B1) >> (32-bits);
+}
+
+//The hash creator doesn't keep the files in memory; only the table, a window of the target around the
+// current position, and a few recently used blocks of each file, to check the matches against.
+static const size_t hash_window = 4*1024*1024; // must be a multiple of hash_block
+static const unsigned hash_cache_shift = 16; // 64KB blocks
+static const size_t hash_cache_blocks = 64;
+
+static size_t hash_window_size(size_t targetlen)
+{
+	//the source is indexed through the same buffer, a window at the time, so it's never smaller than a block
+	size_t len = min(targetlen, hash_window);
+	return max((len+hash_block-1)/hash_block*hash_block, hash_block);
+}
+
+static size_t hash_cache_size(size_t len)
+{
+	return min((len>>hash_cache_shift)+1, hash_cache_blocks);
+}
+
+//Reads a file a block at the time. Block n goes to slot n % numslots, replacing whatever was there.
+struct hash_cache {
+	file* f;
+	size_t len;
+	size_t numslots;
+	uint8_t* mem;
+	size_t blockof[hash_cache_blocks]; // SIZE_MAX if the slot is empty
+	bool ioerror;
+	
+	hash_cache(file* f)
+	{
+		this->f = f;
+		len = f->len();
+		numslots = hash_cache_size(len);
+		mem = (uint8_t*)malloc(numslots<<hash_cache_shift);
+		for (size_t i=0;i<hash_cache_blocks;i++) blockof[i] = SIZE_MAX;
+		ioerror = false;
+	}
+	~hash_cache() { free(mem); }
+	
+	//Returns a pointer to byte 'pos', and sets 'avail' to how many bytes from there are in the same block.
+	//Returns NULL if it can't be read.
+	const uint8_t* get(size_t pos, size_t* avail)
+	{
+		size_t block = pos>>hash_cache_shift;
+		size_t blockstart = block<<hash_cache_shift;
+		size_t blocklen = min((size_t)1<<hash_cache_shift, len-blockstart);
+		uint8_t* slot = mem + ((block%numslots)<<hash_cache_shift);
+		if (blockof[block%numslots] != block)
+		{
+			blockof[block%numslots] = SIZE_MAX;
+			if (!f->read(slot, blockstart, blocklen))
+			{
+				ioerror = true;
+				return NULL;
+			}
+			blockof[block%numslots] = block;
+		}
+		*avail = blocklen - (pos-blockstart);
+		return slot + (pos-blockstart);
+	}
+	
+	//How many bytes from 'pos' are the same as 'data', at most 'maxlen'.
+	size_t match(size_t pos, const uint8_t* data, size_t maxlen)
+	{
+		size_t len = 0;
+		while (len < maxlen)
+		{
+			size_t avail;
+			const uint8_t* here = get(pos+len, &avail);
+			if (!here) break;
+			size_t n = min(avail, maxlen-len);
+			size_t same = bytecmp_len(here, data+len, n);
+			len += same;
+			if (same < n) break;
+		}
+		return len;
+	}
+	
+	//How many bytes right before 'pos' are the same as those before 'data', at most 'maxlen'.
+	size_t match_back(size_t pos, const uint8_t* data, size_t maxlen)
+	{
+		size_t len = 0;
+		while (len < maxlen)
+		{
+			size_t avail;
+			const uint8_t* here = get(pos-len-1, &avail);
+			if (!here || *here != data[-(ptrdiff_t)len-1]) break;
+			len++;
+		}
+		return len;
+	}
+};
+
+//table[] has 1<<bits entries, all zero. Each is either zero, or a source position plus one, or a target
+// position plus sourcelen plus one, with some more bits of the hash above that; on collisions, the newest
+// block wins. It's a bit like xdelta. The extra bits mean most collisions are found without reading the
+// files.
+struct hash_matcher {
+	size_t* table;
+	unsigned bits;
+	unsigned posbits;
+	unsigned tagbits;
+	
+	hash_matcher(size_t* table, unsigned bits, size_t maxpos)
+	{
+		this->table = table;
+		this->bits = bits;
+		posbits = 1;
+		while (posbits < sizeof(size_t)*8 && (maxpos>>posbits)) posbits++;
+		tagbits = min((unsigned)(sizeof(size_t)*8 - posbits), 16u);
+	}
+	
+	size_t tag(uint32_t h) const
+	{
+		if (!tagbits) return 0;
+		return (uint32_t)(h*0x85EBCA77) >> (32-tagbits);
+	}
+	
+	void add(uint32_t h, size_t pos)
+	{
+		table[hash_slot(h, bits)] = (tag(h)<<posbits) | (pos+1);
+	}
+	
+	//Returns whether there's an entry for this hash, and if so, puts its position in 'pos'.
+	bool find(uint32_t h, size_t* pos) const
+	{
+		size_t entry = table[hash_slot(h, bits)];
+		if (!entry || (entry>>posbits) != tag(h)) return false;
+		*pos = (entry & (((size_t)1<<posbits)-1)) - 1;
+		return true;
+	}
+};
+
+static bpserror bps_create_hash_core(file* source, file* target, size_t* table, unsigned bits, struct bps_creator * out)
+{
+	size_t sourcelen = source->len();
+	size_t targetlen = target->len();
+	hash_matcher hashes(table, bits, sourcelen+targetlen+1);
+	
+	size_t winsize = hash_window_size(targetlen);
+	uint8_t* win = (uint8_t*)malloc(winsize);
+	hash_cache srccache(source);
+	hash_cache tgtcache(target);
+	if (!win || !srccache.mem || !tgtcache.mem)
+	{
+		free(win);
+		return bps_out_of_mem;
+	}
+	
+	//the window is a multiple of hash_block, so the blocks are where they'd be if it was all read at once
+	uint32_t sourcecrc = 0;
+	for (size_t start=0;start<sourcelen;start+=winsize)
+	{
+		size_t n = min(winsize, sourcelen-start);
+		if (!source->read(win, start, n))
+		{
+			free(win);
+			return bps_io;
+		}
+		sourcecrc = crc32_update(win, n, sourcecrc);
+		for (size_t i=0;i+hash_block<=n;i+=hash_block) hashes.add(hash_init(win+i), start+i);
+	}
+	
+	//hash_block-1 multiplications of hash_mul, to remove the oldest byte from the rolling hash
+	uint32_t hash_out = 1;
+	for (size_t i=1;i<hash_block;i++) hash_out *= hash_mul;
+	
+	size_t winstart = 0; // win[0] is this target byte
+	size_t winend = 0;
+	uint32_t targetcrc = 0;
 	
-	while ((patchmem->ptr[maindata]&0x80) == 0x00) maindata++;
-	if (maindata==patchmem->len-12-1) return bps_identical;
+	size_t outpos = 0;
+	size_t targetindexed = 0; // all target blocks starting before this are in the table
+	size_t hashpos = (size_t)-1; // h is valid if this is outpos
+	uint32_t h = 0;
+	size_t nextprogress = 0;
+	
+	//where the last match ended, if it was taken whole; if it was cut off by the window, it continues there
+	bool cont = false;
+	bool conttarget = false;
+	size_t contpos = 0;
+	
+	while (outpos < targetlen)
+	{
+		if (outpos >= nextprogress)
+		{
+			if (!out->progress(outpos, targetlen))
+			{
+				free(win);
+				return bps_canceled;
+			}
+			nextprogress = outpos + 1024*1024;
+		}
+		
+		//a TargetCopy may overlap the bytes it creates, so the block doesn't need to be entirely behind outpos
+		for (int pass=0;pass<2;pass++)
+		{
+			while (targetindexed < outpos && targetindexed+hash_block <= winend)
+			{
+				hashes.add(hash_init(win+(targetindexed-winstart)), sourcelen+targetindexed);
+				targetindexed += hash_block;
+			}
+			
+			//keep at least half a window ahead; behind outpos, only the pending TargetRead and the blocks
+			// not yet indexed are needed, and the former is sent off first
+			if (pass || winend == targetlen || outpos+winsize/2 <= winend) break;
+			out->flush_target_read();
+			size_t keep = min(outpos, targetindexed);
+			memmove(win, win+(keep-winstart), winend-keep);
+			winstart = keep;
+			size_t n = min(winsize-(winend-winstart), targetlen-winend);
+			if (!target->read(win+(winend-winstart), winend, n))
+			{
+				free(win);
+				return bps_io;
+			}
+			targetcrc = crc32_update(win+(winend-winstart), n, targetcrc);
+			winend += n;
+			out->move_target(win, winstart);
+			hashpos = (size_t)-1;
+		}
+		
+		const uint8_t* here = win+(outpos-winstart);
+		size_t ahead = winend-outpos;
+		
+		//SourceRead is the cheapest command, so that's checked first
+		size_t bestlen = 0;
+		size_t bestback = 0;
+		size_t bestpos = outpos;
+		bool besttarget = false;
+		if (outpos < sourcelen) bestlen = srccache.match(outpos, here, min(sourcelen-outpos, ahead));
+		
+		size_t candpos[2];
+		bool candtarget[2];
+		int numcands = 0;
+		if (cont && (conttarget || contpos != outpos) && contpos < (conttarget ? targetlen : sourcelen))
+		{
+			candpos[numcands] = contpos;
+			candtarget[numcands] = conttarget;
+			numcands++;
+		}
+		if (outpos+hash_block <= winend)
+		{
+			if (hashpos != outpos) h = hash_init(here);
+			hashpos = outpos;
+			
+			size_t entry;
+			if (hashes.find(h, &entry))
+			{
+				candtarget[numcands] = (entry >= sourcelen);
+				candpos[numcands] = (entry >= sourcelen ? entry-sourcelen : entry);
+				numcands++;
+			}
+		}
+		
+		for (int i=0;i<numcands;i++)
+		{
+			bool is_target = candtarget[i];
+			size_t pos = candpos[i];
+			hash_cache& data = (is_target ? tgtcache : srccache);
+			size_t maxlen = min((is_target ? targetlen : sourcelen) - pos, ahead);
+			
+			size_t len = data.match(pos, here, maxlen);
+			//the match may start in the middle of the TargetRead before it
+			size_t back = 0;
+			if (len) back = data.match_back(pos, here, min(out->numtargetread, pos));
+			//if it's that short, match() may reject it, and then it'd get stuck
+			if (len+back < 8) back = 0;
+			if (len+back > bestlen+bestback)
+			{
+				bestlen = len;
+				bestback = back;
+				bestpos = pos;
+				besttarget = is_target;
+			}
+		}
+		if (srccache.ioerror || tgtcache.ioerror)
+		{
+			free(win);
+			return bps_io;
+		}
+		
+		out->unread_target(bestback);
+		size_t taken = out->match(besttarget, bestpos-bestback, bestlen+bestback) - bestback;
+#ifdef TEST_CORRECT
+		hash_cache& check = (besttarget ? tgtcache : srccache);
+		if (check.match(bestpos-bestback, here-bestback, bestlen+bestback) != bestlen+bestback)
+			puts("ERROR: found match doesn't match"),abort();
+		if (besttarget && bestpos >= outpos) puts("ERROR: found match in invalid location"),abort();
+#endif
+		outpos += taken;
+		
+		cont = (bestlen && taken == bestlen);
+		conttarget = besttarget;
+		contpos = bestpos+bestlen;
+		
+		if (taken == 1 && hashpos+1 == outpos && outpos+hash_block <= winend)
+		{
+			h = (h - win[hashpos-winstart]*hash_out)*hash_mul + win[hashpos+hash_block-winstart];
+			hashpos = outpos;
+		}
+	}
+	
+	out->finish_crc(sourcecrc, targetcrc);
+	free(win);
 	return bps_ok;
 }
 
+static bpserror bps_create_hash_main(file* source, file* target, struct mem metadata,
+                                     struct mem * patchmem, filewrite* patchfile,
+                                     bool (*progress)(void* userdata, size_t done, size_t total), void* userdata,
+                                     size_t tablesize)
+{
+	size_t sourcelen = source->len();
+	size_t targetlen = target->len();
+	
+	if (sourcelen+targetlen < sourcelen) return bps_too_big;
+	if (sourcelen+targetlen >= bps_creator::maxsize()) return bps_too_big;
+	
+	unsigned bits = hash_table_bits(sourcelen, targetlen, tablesize);
+	
+	size_t* table = (size_t*)calloc((size_t)1<<bits, sizeof(size_t));
+	if (!table) return bps_out_of_mem;
+	
+	bps_creator bps(source, target, metadata, patchfile);
+	bps.setProgress(progress, userdata);
+	
+	bpserror err = bps_create_hash_core(source, target, table, bits, &bps);
+	if (err == bps_ok) err = bps_getpatch(&bps, patchmem);
+	
+	free(table);
+	return err;
+}
+
+enum bpserror bps_create_hash(file* source, file* target, struct mem metadata, struct mem * patch,
+                              bool (*progress)(void* userdata, size_t done, size_t total), void* userdata,
+                              size_t tablesize)
+{
+	return bps_create_hash_main(source, target, metadata, patch, NULL, progress, userdata, tablesize);
+}
+
+enum bpserror bps_create_hash_file(file* source, file* target, struct mem metadata, filewrite* patch,
+                                   bool (*progress)(void* userdata, size_t done, size_t total), void* userdata,
+                                   size_t tablesize)
+{
+	return bps_create_hash_main(source, target, metadata, NULL, patch, progress, userdata, tablesize);
+}
+
+//The patch itself can, in the worst case, be as big as the target, so that's included everywhere.
+//divsufsort sorts in place, except for its bucket arrays (256 and 256*256 ints), allocated on every call.
+static const size_t sufsort_memory = sizeof(int32_t)*(256 + 256*256);
+
+size_t bps_create_delta_memory(size_t sourcelen, size_t targetlen, bool moremem, bool indexed)
+{
+	size_t sortedlen = (indexed ? targetlen : sourcelen+targetlen);
+	size_t ret = big_malloc_size(sourcelen+targetlen); // mem_joined
+	ret += big_malloc_size(sizeof(int32_t)*sortedlen) * (moremem ? 2 : 1);
+	ret += sizeof(int32_t)*sortedlen/63; // skip
+	ret += sizeof(int32_t)*65537*2; // buckets, plus the source buckets once the target is re-sorted
+	ret += sufsort_memory;
+#ifdef _OPENMP
+	//the search pieces, see bps_create_suf_core
+	size_t threads = omp_get_max_threads();
+	if (threads > 1 && targetlen > 65536) ret += big_malloc_size(sizeof(int32_t)*65536*threads) * 2;
+#endif
+	ret += targetlen;
+	return ret;
+}
+
+size_t bps_create_optimal_memory(size_t sourcelen, size_t targetlen)
+{
+	//two candidate arrays, and two parse nodes per target byte
+	return bps_create_delta_memory(sourcelen, targetlen, false, false) +
+	       targetlen*(sizeof(uint32_t)*2 + sizeof(bps_creator::parsenode)*2);
+}
+
+size_t bps_create_hash_file_memory(size_t sourcelen, size_t targetlen, size_t tablesize)
+{
+	//the table, the target window, the two block caches, and the unsent part of the patch
+	return (sizeof(size_t)<<hash_table_bits(sourcelen, targetlen, tablesize)) + hash_window_size(targetlen) +
+	       ((hash_cache_size(sourcelen)+hash_cache_size(targetlen))<<hash_cache_shift) + bps_creator::flushsize*2;
+}
+
+size_t bps_create_hash_memory(size_t sourcelen, size_t targetlen, size_t tablesize)
+{
+	//same, but the patch is kept in memory; it's at most slightly bigger than the target
+	return bps_create_hash_file_memory(sourcelen, targetlen, tablesize) + targetlen;
+}
+
 enum bpserror bps_create_delta_inmem(struct mem source, struct mem target, struct mem metadata, struct mem * patch,
                                bool (*progress)(void* userdata, size_t done, size_t total), void* userdata,
                                bool moremem)
@@ -9,6 +9,11 @@
 #include <string.h>//memcpy, memset
 #include <stdint.h>//uint8_t, uint32_t
 #include "crc32.h"//crc32
+#include "phasetime.h"
+#include "bytecmp.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 static uint32_t read32(uint8_t * ptr)
 {
@@ -56,9 +61,12 @@ static bool decodenum(const uint8_t*& ptr, size_t& out)
 #define error(which) do { error=which; goto exit; } while(0)
 #define assert_sum(a,b) do { if (SIZE_MAX-(a)<(b)) error(bps_too_big); } while(0)
 #define assert_shift(a,b) do { if (SIZE_MAX>>(b)<(a)) error(bps_too_big); } while(0)
-enum bpserror bps_apply(struct mem patch, struct mem in, struct mem * out, struct mem * metadata, bool accept_wrong_input)
+enum bpserror bps_apply_stats(struct mem patch, struct mem in, struct mem * out, struct mem * metadata, bool accept_wrong_input,
+                              struct bps_stats * stats)
 {
 	enum bpserror error = bps_ok;
+	struct phasetime_clock clock = { 0, 0 };
+	if (stats) phasetime_start(&clock);
 	out->len=0;
 	out->ptr=NULL;
 	if (metadata)
@@ -91,6 +99,7 @@ enum bpserror bps_apply(struct mem patch, struct mem in, struct mem * out, struc
 		
 		uint32_t crc_in_a = crc32(in.ptr, in.len);
 		uint32_t crc_patch_a = crc32(patch.ptr, patch.len-4);
+		phasetime_lap(&clock, stats ? &stats->crc : NULL);
 		
 		if (crc_patch_a != crc_patch_e) error(bps_broken);
 		
@@ -134,6 +143,8 @@ enum bpserror bps_apply(struct mem patch, struct mem in, struct mem * out, struc
 			for (size_t i=0;i<metadatalen;i++) (void)read8();
 		}
 		
+		size_t cmd_count[4]={0,0,0,0};
+		size_t cmd_bytes[4]={0,0,0,0};
 		while (patchat<patchend)
 		{
 			size_t thisinstr;
@@ -141,6 +152,8 @@ enum bpserror bps_apply(struct mem patch, struct mem in, struct mem * out, struc
 			size_t length=(thisinstr>>2)+1;
 			int action=(thisinstr&3);
 			if (outat+length>outend) error(bps_broken);
+			cmd_count[action]++;
+			cmd_bytes[action]+=length;
 			
 			switch (action)
 			{
@@ -188,8 +201,18 @@ enum bpserror bps_apply(struct mem patch, struct mem in, struct mem * out, struc
 		}
 		if (patchat!=patchend) error(bps_broken);
 		if (outat!=outend) error(bps_broken);
+		phasetime_lap(&clock, stats ? &stats->apply : NULL);
+		if (stats)
+		{
+			for (int i=0;i<4;i++)
+			{
+				stats->cmd_count[i]+=cmd_count[i];
+				stats->cmd_bytes[i]+=cmd_bytes[i];
+			}
+		}
 		
 		uint32_t crc_out_a = crc32(out->ptr, out->len);
+		phasetime_lap(&clock, stats ? &stats->crc : NULL);
 		
 		if (crc_out_a!=crc_out_e)
 		{
@@ -215,17 +238,32 @@ exit:
 	return error;
 }
 
+enum bpserror bps_apply(struct mem patch, struct mem in, struct mem * out, struct mem * metadata, bool accept_wrong_input)
+{
+	return bps_apply_stats(patch, in, out, metadata, accept_wrong_input, NULL);
+}
+
 
 
+//With a patchfile, the buffer is sent there whenever it's full, rather than grown.
 #define write(val) \
 			do { \
 				out[outlen++]=(val); \
 				if (outlen==outbuflen) \
 				{ \
-					outbuflen*=2; \
-					uint8_t* newout=(uint8_t*)realloc(out, outbuflen); \
-					if (!newout) { free(out); return bps_out_of_mem; } \
-					out=newout; \
+					if (patchfile) \
+					{ \
+						outcrc=crc32_update(out, outlen, outcrc); \
+						if (!patchfile->append(out, outlen)) { free(out); return bps_write_failed; } \
+						outlen=0; \
+					} \
+					else \
+					{ \
+						outbuflen*=2; \
+						uint8_t* newout=(uint8_t*)realloc(out, outbuflen); \
+						if (!newout) { free(out); return bps_out_of_mem; } \
+						out=newout; \
+					} \
 				} \
 			} while(0)
 #define write32(val) \
@@ -253,50 +291,186 @@ exit:
 				} \
 			} while(0)
 
-enum bpserror bps_create_linear(struct mem sourcemem, struct mem targetmem, struct mem metadata, struct mem * patchmem)
+#ifdef BYTECMP_SSE2
+//Returns the first position at or after 'start' where bps_create_linear's RLE check may succeed; either
+// five equal bytes from start-1, or five two-byte repeats from start-2. Like bytecmp_skip3, it stops
+// somewhat before 'end', and the caller checks the rest byte by byte. Reads target[start-2] to target[end-1].
+static size_t linear_skip_rle(const uint8_t* target, size_t start, size_t end)
 {
-	if (sourcemem.len>=(SIZE_MAX>>2) - 16) return bps_too_big;//the 16 is just to be on the safe side, I don't think it's needed.
-	if (targetmem.len>=(SIZE_MAX>>2) - 16) return bps_too_big;
+	size_t i = start;
+	while (i+20 <= end)
+	{
+#define load(off) _mm_loadu_si128((const __m128i*)(target+i+(off)))
+		__m128i m2 = load(-2);
+		__m128i m1 = load(-1);
+		__m128i c0 = load(0);
+		__m128i p1 = load(1);
+		__m128i p2 = load(2);
+		__m128i p3 = load(3);
+		__m128i p4 = load(4);
+#undef load
+		__m128i one = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(m1, c0), _mm_cmpeq_epi8(c0, p1)),
+		                            _mm_and_si128(_mm_cmpeq_epi8(p1, p2), _mm_cmpeq_epi8(p2, p3)));
+		__m128i two = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(m2, c0), _mm_cmpeq_epi8(m1, p1)),
+		                            _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(c0, p2), _mm_cmpeq_epi8(p1, p3)),
+		                                          _mm_cmpeq_epi8(p2, p4)));
+		unsigned mask = _mm_movemask_epi8(_mm_or_si128(one, two));
+		if (mask)
+		{
+#if defined(__GNUC__)
+			return i + __builtin_ctz(mask);
+#else
+			while (!(mask&1)) { mask >>= 1; i++; }
+			return i;
+#endif
+		}
+		i += 16;
+	}
+	return i;
+}
+#else
+static size_t linear_skip_rle(const uint8_t* target, size_t start, size_t end) { return start; }
+#endif
+
+//Linear patches are made in pieces of about this size, spread over all threads. Each piece ends in the
+// middle of LINEAR_SEAM bytes where the source and target agree, so the SourceReads on both sides can be
+// merged, and the patch is the same as if it was made in one go; the only exception is a TargetCopy
+// run that crosses a seam, which gets cut in two. Where there is no such spot, the piece is made longer.
+#define LINEAR_CHUNK (4*1024*1024)
+#define LINEAR_SEAM 16
+//bps_create_linear_stream reads this much of each file at the time, and needs this many bytes before
+// and after each piece; that's also where it cuts a piece if there's no seam in its window.
+#define LINEAR_WINDOW (LINEAR_CHUNK*2)
+#define LINEAR_MARGIN 16
+
+struct linear_chunk {
+	size_t start;
+	size_t end;
+	enum bpserror error;
 	
-	const uint8_t * source=sourcemem.ptr;
-	const uint8_t * sourceend=sourcemem.ptr+sourcemem.len;
-	if (sourcemem.len>targetmem.len) sourceend=sourcemem.ptr+targetmem.len;
-	const uint8_t * targetbegin=targetmem.ptr;
-	const uint8_t * target=targetmem.ptr;
-	const uint8_t * targetend=targetmem.ptr+targetmem.len;
+	uint8_t * out;
+	size_t outlen;
+	size_t numcmds;
+	bool onlysourceread;
 	
-	const uint8_t * targetcopypos=targetbegin;
+	//if the first command is SourceRead, its length and how many bytes it's encoded to; otherwise 0
+	size_t headlen;
+	size_t headsize;
+	//same for the last command, unless it's also the first; tailat is where it starts, or outlen if not
+	size_t taillen;
+	size_t tailat;
+	//TargetCopy distances are relative to the previous one, which may be in another piece, so the first
+	// distance is left out; it goes at copyat, and reads from target+copyfrom. copyend is where the last
+	// one ended. copyat is SIZE_MAX if there are none.
+	size_t copyat;
+	size_t copyfrom;
+	size_t copyend;
 	
-	size_t outbuflen=4096;
+	uint32_t sourcecrc;
+	size_t sourcecrclen;
+	uint32_t targetcrc;
+};
+
+//Returns the middle of the first LINEAR_SEAM bytes in start..end where source and target are equal, or 0 if none.
+static size_t linear_find_seam(const uint8_t * source, const uint8_t * target, size_t start, size_t end)
+{
+	size_t pos=start;
+	while (pos+LINEAR_SEAM<=end)
+	{
+		pos+=bytecmp_skip3(source+pos, target+pos, end-pos);
+		size_t same=bytecmp_len(source+pos, target+pos, end-pos);
+		if (same>=LINEAR_SEAM) return pos+LINEAR_SEAM/2;
+		pos+=same+1;
+	}
+	return 0;
+}
+
+#define writemem(ptr, len) \
+			do { \
+				const uint8_t * tmpptr=(ptr); \
+				size_t tmplen=(len); \
+				while (tmplen) \
+				{ \
+					/* copy as much as fits, then let write() make room for the rest */ \
+					size_t n=outbuflen-outlen-1; \
+					if (n>tmplen) n=tmplen; \
+					memcpy(out+outlen, tmpptr, n); \
+					outlen+=n; \
+					tmpptr+=n; \
+					tmplen-=n; \
+					if (tmplen) { write(*tmpptr++); tmplen--; } \
+				} \
+			} while(0)
+#define writecopy(from) \
+			do { \
+				if (targetcopypos) writenum(((from)-targetcopypos)<<1); \
+				else \
+				{ \
+					chunk->copyat=outlen; \
+					chunk->copyfrom=(from)-targetwin+base; \
+				} \
+			} while(0)
+
+//Makes the commands for target[chunk->start] to target[chunk->end], and the checksums of that part; the
+// checksum of the source doesn't include anything after the end of the target. 'sourcemem' and
+// 'targetmem' start at position 'base' of the files, and the source is 'sourcelen' bytes long.
+static enum bpserror bps_create_linear_chunk(struct mem sourcemem, struct mem targetmem, size_t base, size_t sourcelen,
+                                             struct linear_chunk * chunk)
+{
+	filewrite* patchfile=NULL; // the pieces are always kept in memory
+	uint32_t outcrc=0;
+	size_t outbuflen=chunk->end-chunk->start+4096; // it rarely needs more than that
 	uint8_t * out=(uint8_t*)malloc(outbuflen);
 	if (!out) return bps_out_of_mem;
 	size_t outlen=0;
-	write('B');
-	write('P');
-	write('S');
-	write('1');
-	writenum(sourcemem.len);
-	writenum(targetmem.len);
-	writenum(metadata.len);
-	for (size_t i=0;i<metadata.len;i++) write(metadata.ptr[i]);
 	
-	size_t mainContentPos=outlen;
+	size_t sourcestop=(sourcelen<chunk->end ? sourcelen : chunk->end);
+	if (sourcestop<chunk->start) sourcestop=chunk->start;
+	const uint8_t * source=sourcemem.ptr+chunk->start-base;
+	const uint8_t * sourceend=sourcemem.ptr+sourcestop-base;
+	const uint8_t * targetwin=targetmem.ptr;
+	const uint8_t * target=targetwin+chunk->start-base;
+	const uint8_t * targetend=targetwin+chunk->end-base;
+	
+	const uint8_t * targetcopypos=NULL; // unknown until the first TargetCopy
+	
+	size_t numcmds=0;
+	bool onlysourceread=true;
+	chunk->headlen=0;
+	chunk->headsize=0;
+	chunk->taillen=0;
+	chunk->copyat=SIZE_MAX;
 	
-	const uint8_t * lastknownchange=targetbegin;
+	const uint8_t * lastknownchange=target;
 	while (target<targetend)
 	{
-		size_t numunchanged=0;
-		while (source+numunchanged<sourceend && source[numunchanged]==target[numunchanged]) numunchanged++;
+		size_t numunchanged=(source<sourceend ? bytecmp_len(source, target, sourceend-source) : 0);
 		if (numunchanged>1 || numunchanged == (uintptr_t)(targetend-target))
 		{
 			//assert_shift((numunchanged-1), 2);
-			writenum((numunchanged-1)<<2 | 0);//SourceRead
+			if (numcmds==0)
+			{
+				writenum((numunchanged-1)<<2 | SourceRead);
+				chunk->headlen=numunchanged;
+				chunk->headsize=outlen;
+			}
+			else
+			{
+				chunk->tailat=outlen;
+				writenum((numunchanged-1)<<2 | SourceRead);
+				chunk->taillen=numunchanged;
+			}
+			numcmds++;
 			source+=numunchanged;
 			target+=numunchanged;
 		}
 		
 		size_t numchanged=0;
 		if (lastknownchange>target) numchanged=lastknownchange-target;
+		//sourceend is never after the corresponding position in the target, so this stays in bounds;
+		// the loop below takes care of the last few bytes, and the end of the source
+		if (source+numchanged<sourceend)
+			numchanged+=bytecmp_skip3(source+numchanged, target+numchanged, sourceend-source-numchanged);
 		while ((source+numchanged>=sourceend ||
 		        source[numchanged]!=target[numchanged] ||
 		        source[numchanged+1]!=target[numchanged+1] ||
@@ -310,9 +484,11 @@ enum bpserror bps_create_linear(struct mem sourcemem, struct mem targetmem, stru
 		if (numchanged)
 		{
 			//assert_shift((numchanged-1), 2);
-			size_t rle1start=(target==targetbegin);
+			size_t pos=target-targetwin+base; // in the file
+			size_t rle1start=(pos==0);
 			while (true)
 			{
+				if (pos+rle1start >= 2) rle1start=linear_skip_rle(target, rle1start, numchanged);
 				if (
 					target[rle1start-1]==target[rle1start+0] &&
 					target[rle1start+0]==target[rle1start+1] &&
@@ -322,7 +498,7 @@ enum bpserror bps_create_linear(struct mem sourcemem, struct mem targetmem, stru
 					numchanged=rle1start;
 					break;
 				}
-				if (
+				if (pos+rle1start >= 2 &&
 					target[rle1start-2]==target[rle1start+0] &&
 					target[rle1start-1]==target[rle1start+1] &&
 					target[rle1start+0]==target[rle1start+2] &&
@@ -338,20 +514,28 @@ enum bpserror bps_create_linear(struct mem sourcemem, struct mem targetmem, stru
 			if (numchanged)
 			{
 				writenum((numchanged-1)<<2 | TargetRead);
-				for (size_t i=0;i<numchanged;i++)
-				{
-					write(target[i]);
-				}
+				numcmds++;
+				onlysourceread=false;
+				chunk->taillen=0;
+				writemem(target, numchanged);
 				source+=numchanged;
 				target+=numchanged;
 			}
-			if (target[-2]==target[0] && target[-1]==target[1] && target[0]==target[2])
+			//the RLEs must stay inside the piece, and can't copy from before the start of the file
+			if (target==targetend) continue;
+			if (pos+numchanged >= 2 && target[-2]==target[0] && target[-1]==target[1] && target[0]==target[2])
 			{
 				//two-byte RLE
+				//the first pair always matches; target[i+2]==target[i] for the next 'same' bytes
 				size_t rlelen=0;
-				while (target+rlelen<targetend && target[0]==target[rlelen+0] && target[1]==target[rlelen+1]) rlelen+=2;
+				if (targetend-target > 2) rlelen=2+(bytecmp_len(target+2, target, targetend-target-2) & ~(size_t)1);
+				while (target+rlelen+1<targetend && target[0]==target[rlelen+0] && target[1]==target[rlelen+1]) rlelen+=2;
+				if (!rlelen) rlelen=1; // only one byte left
 				writenum((rlelen-1)<<2 | TargetCopy);
-				writenum((target-targetcopypos-2)<<1);
+				writecopy(target-2);
+				numcmds++;
+				onlysourceread=false;
+				chunk->taillen=0;
 				source+=rlelen;
 				target+=rlelen;
 				targetcopypos=target-2;
@@ -360,9 +544,13 @@ enum bpserror bps_create_linear(struct mem sourcemem, struct mem targetmem, stru
 			{
 				//one-byte RLE
 				size_t rlelen=0;
+				if (target<targetend) rlelen=1+bytecmp_len(target+1, target, targetend-target-1);
 				while (target+rlelen<targetend && target[0]==target[rlelen]) rlelen++;
 				writenum((rlelen-1)<<2 | TargetCopy);
-				writenum((target-targetcopypos-1)<<1);
+				writecopy(target-1);
+				numcmds++;
+				onlysourceread=false;
+				chunk->taillen=0;
 				source+=rlelen;
 				target+=rlelen;
 				targetcopypos=target-1;
@@ -370,26 +558,458 @@ enum bpserror bps_create_linear(struct mem sourcemem, struct mem targetmem, stru
 		}
 	}
 	
-	write32(crc32(sourcemem.ptr, sourcemem.len));
-	write32(crc32(targetmem.ptr, targetmem.len));
-	write32(crc32(out, outlen));
+	if (!chunk->taillen) chunk->tailat=outlen;
+	if (targetcopypos) chunk->copyend=targetcopypos-targetwin+base;
+	chunk->out=out;
+	chunk->outlen=outlen;
+	chunk->numcmds=numcmds;
+	chunk->onlysourceread=onlysourceread;
+	
+	size_t sourcestart=(sourcelen<chunk->start ? sourcelen : chunk->start);
+	if (sourcestop>sourcelen) sourcestop=sourcelen;
+	chunk->sourcecrc=(sourcestop>sourcestart ? crc32(sourcemem.ptr+sourcestart-base, sourcestop-sourcestart) : 0);
+	chunk->sourcecrclen=sourcestop-sourcestart;
+	chunk->targetcrc=crc32(targetwin+chunk->start-base, chunk->end-chunk->start);
+	return bps_ok;
+}
+#undef writecopy
+
+static size_t linear_threads()
+{
+	//inside create-many's threads, there's nobody left to share with
+#ifdef _OPENMP
+	if (!omp_in_parallel()) return omp_get_max_threads();
+#endif
+	return 1;
+}
+
+//Hands out the encoded pieces to bps_create_linear_stitch, in order, a few at the time.
+class linear_pieces {
+public:
+	//Sets *count to 0 after the last one. The pieces stay valid until the next call; take their 'out'
+	// and set it to NULL, or it's freed along with this object.
+	virtual enum bpserror next(struct linear_chunk ** chunks, size_t * count) = 0;
+	//The checksum of whatever the source has after the end of the target.
+	virtual enum bpserror sourcetail(uint32_t * crc) = 0;
+	//The checksum of the entire source, if it's known without reading it; see file::known_crc32.
+	virtual bool knownsourcecrc(uint32_t * crc) { (void)crc; return false; }
+	virtual ~linear_pieces() {}
+};
+
+//Both files are in memory, so the seams are found first, and then the pieces between them are made
+// two per thread at the time.
+class linear_pieces_mem : public linear_pieces {
+public:
+	struct mem sourcemem;
+	struct mem targetmem;
+	
+	size_t * seams;
+	size_t numchunks;
+	size_t first;
+	
+	struct linear_chunk * chunks;
+	size_t batch;
+	
+	linear_pieces_mem(struct mem sourcemem, struct mem targetmem) : sourcemem(sourcemem), targetmem(targetmem)
+	{
+		seams=NULL;
+		numchunks=0;
+		first=0;
+		chunks=NULL;
+		batch=0;
+	}
+	
+	enum bpserror init()
+	{
+		//a stretch without a seam is joined to the previous piece
+		size_t sameend=(sourcemem.len<targetmem.len ? sourcemem.len : targetmem.len);
+		size_t numstretches=targetmem.len/LINEAR_CHUNK+1;
+		seams=(size_t*)malloc(sizeof(size_t)*(numstretches+1));
+		if (!seams) return bps_out_of_mem;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+		for (ptrdiff_t i=1;i<(ptrdiff_t)numstretches;i++)
+		{
+			size_t end=(i+1)*(size_t)LINEAR_CHUNK;
+			if (end>sameend) end=sameend;
+			seams[i]=linear_find_seam(sourcemem.ptr, targetmem.ptr, i*(size_t)LINEAR_CHUNK, end);
+		}
+		seams[0]=0;
+		numchunks=1;
+		for (size_t i=1;i<numstretches;i++)
+		{
+			if (seams[i]) seams[numchunks++]=seams[i];
+		}
+		seams[numchunks]=targetmem.len;
+		
+		batch=linear_threads()*2;
+		chunks=(struct linear_chunk*)malloc(sizeof(struct linear_chunk)*batch);
+		if (!chunks) return bps_out_of_mem;
+		for (size_t i=0;i<batch;i++) chunks[i].out=NULL;
+		return bps_ok;
+	}
+	
+	enum bpserror next(struct linear_chunk ** ret, size_t * count)
+	{
+		size_t n=numchunks-first;
+		if (n>batch) n=batch;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+		for (ptrdiff_t i=0;i<(ptrdiff_t)n;i++)
+		{
+			chunks[i].start=seams[first+i];
+			chunks[i].end=seams[first+i+1];
+			chunks[i].error=bps_create_linear_chunk(sourcemem, targetmem, 0, sourcemem.len, &chunks[i]);
+		}
+		first+=n;
+		
+		*ret=chunks;
+		*count=n;
+		for (size_t i=0;i<n;i++)
+		{
+			if (chunks[i].error!=bps_ok) return chunks[i].error;
+		}
+		return bps_ok;
+	}
+	
+	enum bpserror sourcetail(uint32_t * crc)
+	{
+		*crc=crc32(sourcemem.ptr+targetmem.len, sourcemem.len-targetmem.len);
+		return bps_ok;
+	}
+	
+	~linear_pieces_mem()
+	{
+		if (chunks)
+		{
+			for (size_t i=0;i<batch;i++) free(chunks[i].out);
+		}
+		free(chunks);
+		free(seams);
+	}
+};
+
+//Reads LINEAR_WINDOW bytes of both files per thread at the time, cuts a piece out of that, and
+// continues from there in the next window.
+class linear_pieces_file : public linear_pieces {
+public:
+	file* source;
+	file* target;
+	size_t sourcelen;
+	size_t targetlen;
+	
+	size_t pos; // where the next piece starts
 	
-	patchmem->ptr=out;
-	patchmem->len=outlen;
+	//window i holds the files from bases[i], up to LINEAR_WINDOW bytes, plus LINEAR_MARGIN zeroes
+	// after that, for the few bytes the creator reads past the end of the files
+	uint8_t ** sourcewin;
+	uint8_t ** targetwin;
+	size_t * bases;
+	size_t * sourcewinlen;
+	size_t * targetwinlen;
+	size_t prev; // the last window used; the next one may need some of it
 	
-	//while this may look like it can be fooled by a patch containing exactly one of any other command, it
-	//  can't, because the ones that aren't SourceRead requires an argument
-	size_t i;
-	for (i=mainContentPos;(out[i]&0x80)==0x00;i++) {}
-	if (i==outlen-12-1) return bps_identical;
+	struct linear_chunk * chunks;
+	size_t batch;
 	
+	linear_pieces_file(file* source, file* target) : source(source), target(target)
+	{
+		sourcelen=source->len();
+		targetlen=target->len();
+		pos=0;
+		sourcewin=NULL;
+		targetwin=NULL;
+		bases=NULL;
+		sourcewinlen=NULL;
+		targetwinlen=NULL;
+		prev=SIZE_MAX;
+		chunks=NULL;
+		batch=0;
+	}
+	
+	enum bpserror init()
+	{
+		batch=linear_threads();
+		sourcewin=(uint8_t**)calloc(batch, sizeof(uint8_t*));
+		targetwin=(uint8_t**)calloc(batch, sizeof(uint8_t*));
+		bases=(size_t*)malloc(sizeof(size_t)*batch);
+		sourcewinlen=(size_t*)malloc(sizeof(size_t)*batch);
+		targetwinlen=(size_t*)malloc(sizeof(size_t)*batch);
+		chunks=(struct linear_chunk*)malloc(sizeof(struct linear_chunk)*batch);
+		if (!sourcewin || !targetwin || !bases || !sourcewinlen || !targetwinlen || !chunks) return bps_out_of_mem;
+		for (size_t i=0;i<batch;i++)
+		{
+			chunks[i].out=NULL;
+			sourcewin[i]=(uint8_t*)malloc(LINEAR_WINDOW+LINEAR_MARGIN);
+			targetwin[i]=(uint8_t*)malloc(LINEAR_WINDOW+LINEAR_MARGIN);
+			if (!sourcewin[i] || !targetwin[i]) return bps_out_of_mem;
+		}
+		return bps_ok;
+	}
+	
+	//Fills window 'i' with file[base] onwards, taking what it can from window 'prev'.
+	bool load(file* f, size_t len, uint8_t ** win, size_t * winlen, size_t i, size_t base)
+	{
+		size_t end=base+LINEAR_WINDOW;
+		if (end>len) end=len;
+		if (end<base) end=base;
+		size_t have=base;
+		if (prev!=SIZE_MAX && bases[prev]<=base && bases[prev]+winlen[prev]>base)
+		{
+			have=bases[prev]+winlen[prev];
+			memmove(win[i], win[prev]+(base-bases[prev]), have-base);
+		}
+		if (have<end && !f->read(win[i]+(have-base), have, end-have)) return false;
+		winlen[i]=end-base;
+		memset(win[i]+winlen[i], 0, LINEAR_MARGIN);
+		return true;
+	}
+	
+	enum bpserror next(struct linear_chunk ** ret, size_t * count)
+	{
+		size_t n=0;
+		while (n<batch && pos<targetlen)
+		{
+			size_t base=(pos>LINEAR_MARGIN ? pos-LINEAR_MARGIN : 0);
+			//these two must finish before 'prev' moves on
+			bool ok=load(source, sourcelen, sourcewin, sourcewinlen, n, base);
+			ok=(ok && load(target, targetlen, targetwin, targetwinlen, n, base));
+			bases[n]=base;
+			prev=n;
+			if (!ok) return bps_io;
+			
+			size_t end=base+targetwinlen[n];
+			if (end<targetlen)
+			{
+				size_t sameend=(sourcewinlen[n]<targetwinlen[n] ? sourcewinlen[n] : targetwinlen[n]);
+				size_t seam=0;
+				if (pos-base+LINEAR_CHUNK<sameend)
+					seam=linear_find_seam(sourcewin[n], targetwin[n], pos-base+LINEAR_CHUNK, sameend);
+				if (seam) end=base+seam;
+				else end-=LINEAR_MARGIN;
+			}
+			chunks[n].start=pos;
+			chunks[n].end=end;
+			pos=end;
+			n++;
+		}
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+		for (ptrdiff_t i=0;i<(ptrdiff_t)n;i++)
+		{
+			struct mem s={ sourcewin[i], sourcewinlen[i] };
+			struct mem t={ targetwin[i], targetwinlen[i] };
+			chunks[i].error=bps_create_linear_chunk(s, t, bases[i], sourcelen, &chunks[i]);
+		}
+		
+		*ret=chunks;
+		*count=n;
+		for (size_t i=0;i<n;i++)
+		{
+			if (chunks[i].error!=bps_ok) return chunks[i].error;
+		}
+		return bps_ok;
+	}
+	
+	bool knownsourcecrc(uint32_t * crc)
+	{
+		return source->known_crc32(crc);
+	}
+	
+	enum bpserror sourcetail(uint32_t * crc)
+	{
+		*crc=0;
+		size_t at=targetlen;
+		while (at<sourcelen)
+		{
+			size_t len=sourcelen-at;
+			if (len>LINEAR_WINDOW) len=LINEAR_WINDOW;
+			if (!source->read(sourcewin[0], at, len)) return bps_io;
+			*crc=crc32_update(sourcewin[0], len, *crc);
+			at+=len;
+		}
+		return bps_ok;
+	}
+	
+	~linear_pieces_file()
+	{
+		for (size_t i=0;i<batch;i++)
+		{
+			if (chunks) free(chunks[i].out);
+			if (sourcewin) free(sourcewin[i]);
+			if (targetwin) free(targetwin[i]);
+		}
+		free(sourcewin);
+		free(targetwin);
+		free(bases);
+		free(sourcewinlen);
+		free(targetwinlen);
+		free(chunks);
+	}
+};
+
+//Puts the pieces together. The patch goes to 'patchfile' if it's not NULL, otherwise 'patchmem'.
+static enum bpserror bps_create_linear_stitch(linear_pieces& pieces, size_t sourcelen, size_t targetlen, struct mem metadata,
+                                              struct mem * patchmem, filewrite* patchfile)
+{
+	if (sourcelen>=(SIZE_MAX>>2) - 16) return bps_too_big;//the 16 is just to be on the safe side, I don't think it's needed.
+	if (targetlen>=(SIZE_MAX>>2) - 16) return bps_too_big;
+	
+	size_t outbuflen=(patchfile ? 65536 : 4096);
+	uint8_t * out=(uint8_t*)malloc(outbuflen);
+	if (!out) return bps_out_of_mem;
+	size_t outlen=0;
+	uint32_t outcrc=0; // of the parts already sent to patchfile
+	
+	write('B');
+	write('P');
+	write('S');
+	write('1');
+	writenum(sourcelen);
+	writenum(targetlen);
+	writenum(metadata.len);
+	for (size_t i=0;i<metadata.len;i++) write(metadata.ptr[i]);
+	
+	//the files are identical if there's only one command and it's SourceRead
+	size_t numcmds=0;
+	bool onlysourceread=true;
+	
+	size_t sourceread=0; // held back in case the next piece starts with one too
+	size_t targetcopypos=0;
+	uint32_t sourcecrc=0;
+	uint32_t targetcrc=0;
+	while (true)
+	{
+		struct linear_chunk * chunks;
+		size_t count;
+		enum bpserror error=pieces.next(&chunks, &count);
+		if (error!=bps_ok)
+		{
+			free(out);
+			return error;
+		}
+		if (!count) break;
+		
+		for (size_t i=0;i<count;i++)
+		{
+			struct linear_chunk * chunk=&chunks[i];
+			sourcecrc=crc32_combine(sourcecrc, chunk->sourcecrc, chunk->sourcecrclen);
+			targetcrc=crc32_combine(targetcrc, chunk->targetcrc, chunk->end-chunk->start);
+			
+			sourceread+=chunk->headlen;
+			if (chunk->headsize!=chunk->tailat)
+			{
+				if (sourceread)
+				{
+					writenum((sourceread-1)<<2 | SourceRead);
+					numcmds++;
+				}
+				size_t bodyat=chunk->headsize;
+				if (chunk->copyat!=SIZE_MAX)
+				{
+					writemem(chunk->out+bodyat, chunk->copyat-bodyat);
+					//an RLE cut in two by a piece boundary can make this one go backwards
+					if (chunk->copyfrom>=targetcopypos) writenum((chunk->copyfrom-targetcopypos)<<1);
+					else writenum((targetcopypos-chunk->copyfrom)<<1 | 1);
+					targetcopypos=chunk->copyend;
+					bodyat=chunk->copyat;
+				}
+				writemem(chunk->out+bodyat, chunk->tailat-bodyat);
+				numcmds+=chunk->numcmds - (chunk->headlen!=0) - (chunk->taillen!=0);
+				if (!chunk->onlysourceread) onlysourceread=false;
+				sourceread=chunk->taillen;
+			}
+			free(chunk->out);
+			chunk->out=NULL;
+		}
+	}
+	if (sourceread)
+	{
+		writenum((sourceread-1)<<2 | SourceRead);
+		numcmds++;
+	}
+	uint32_t knowncrc;
+	if (pieces.knownsourcecrc(&knowncrc)) sourcecrc=knowncrc;
+	else if (sourcelen>targetlen)
+	{
+		uint32_t tailcrc;
+		enum bpserror error=pieces.sourcetail(&tailcrc);
+		if (error!=bps_ok)
+		{
+			free(out);
+			return error;
+		}
+		sourcecrc=crc32_combine(sourcecrc, tailcrc, sourcelen-targetlen);
+	}
+	
+	write32(sourcecrc);
+	write32(targetcrc);
+	write32(crc32_update(out, outlen, outcrc));
+	
+	if (patchfile)
+	{
+		bool ok=patchfile->append(out, outlen);
+		free(out);
+		if (!ok) return bps_write_failed;
+	}
+	else
+	{
+		patchmem->ptr=out;
+		patchmem->len=outlen;
+	}
+	
+	if (numcmds==1 && onlysourceread) return bps_identical;
 	return bps_ok;
 }
+#undef writemem
+
+enum bpserror bps_create_linear(struct mem sourcemem, struct mem targetmem, struct mem metadata, struct mem * patchmem)
+{
+	linear_pieces_mem pieces(sourcemem, targetmem);
+	enum bpserror error=pieces.init();
+	if (error!=bps_ok) return error;
+	return bps_create_linear_stitch(pieces, sourcemem.len, targetmem.len, metadata, patchmem, NULL);
+}
+
+enum bpserror bps_create_linear_file(struct mem sourcemem, struct mem targetmem, struct mem metadata, filewrite* patchfile)
+{
+	linear_pieces_mem pieces(sourcemem, targetmem);
+	enum bpserror error=pieces.init();
+	if (error!=bps_ok) return error;
+	return bps_create_linear_stitch(pieces, sourcemem.len, targetmem.len, metadata, NULL, patchfile);
+}
+
+enum bpserror bps_create_linear_stream(file* source, file* target, struct mem metadata, filewrite* patchfile)
+{
+	linear_pieces_file pieces(source, target);
+	enum bpserror error=pieces.init();
+	if (error!=bps_ok) return error;
+	return bps_create_linear_stitch(pieces, pieces.sourcelen, pieces.targetlen, metadata, NULL, patchfile);
+}
 
 #undef write_nocrc
 #undef write
 #undef writenum
 
+size_t bps_create_linear_memory(size_t sourcelen, size_t targetlen)
+{
+	//the patch, which is at most a little bigger than the target, and the pieces being worked on
+	size_t pieces=linear_threads()*2*LINEAR_CHUNK*2;
+	if (pieces>targetlen*2) pieces=targetlen*2;
+	return targetlen+4096+pieces;
+}
+
+size_t bps_create_linear_stream_memory(size_t sourcelen, size_t targetlen)
+{
+	//two windows and a piece per thread, plus some buffers; the piece is usually about as big as the
+	// part of the target it covers, at most the window size
+	return linear_threads()*(LINEAR_WINDOW*3+LINEAR_MARGIN*2) + 65536+4096;
+}
+
 void bps_free(struct mem mem)
 {
 	free(mem.ptr);
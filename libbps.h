@@ -30,18 +30,56 @@ enum bpserror {
 	bps_too_big,   //Somehow, you're asking for something a size_t can't represent.
 	bps_out_of_mem,//Memory allocation failure.
 	bps_canceled,  //The callback returned false.
+	bps_wrong_index,//The source index is broken, or made from another file.
+	bps_write_failed,//The patch couldn't be written to the given filewrite.
 	
 	bps_shut_up_gcc//This one isn't used, it's just to kill a stray comma warning.
 };
 
+//Where the time goes, and what the patch is made of. Everything is added to what's already there,
+//  so memset it to zero first, or keep adding to get the totals of many calls.
+struct bps_stats {
+	struct phase_time alloc; //Allocating the creator's arrays; with huge pages, that includes faulting them in.
+	struct phase_time read;  //Reading the source and target into memory.
+	struct phase_time sort;  //Suffix sorting.
+	struct phase_time index; //Inverse index, buckets and LCP array; everything the search needs that isn't sorting.
+	struct phase_time search;//Looking for matches.
+	struct phase_time emit;  //Picking and encoding commands, and writing the patch. Where it takes turns
+	                         //  with the search, it's timed by wall clock only, and cpu is set to the same.
+	struct phase_time crc;   //Checksums of the source, target and patch. With a filewrite, the patch
+	                         //  checksum is mostly done as it's written, under emit.
+	struct phase_time apply; //Running the commands; only bps_apply.
+	
+	//How many commands of each type, and how many bytes of the output they make; indexed by SourceRead,
+	//  TargetRead, SourceCopy, TargetCopy (0-3, as in the patch format).
+	size_t cmd_count[4];
+	size_t cmd_bytes[4];
+};
+
 //Applies the given BPS patch to the given ROM and puts it in 'out'. Metadata, if present and
 // requested ('metadata'!=NULL), is also returned. Send both to bps_free when you're done with them.
 //If accept_wrong_input is true, it may return bps_to_output or bps_not_this, while putting non-NULL in out/metadata.
 enum bpserror bps_apply(struct mem patch, struct mem in, struct mem * out, struct mem * metadata, bool accept_wrong_input);
+//Same as bps_apply, but also fills in crc, apply and the command counts of 'stats' (if not NULL).
+enum bpserror bps_apply_stats(struct mem patch, struct mem in, struct mem * out, struct mem * metadata, bool accept_wrong_input,
+                              struct bps_stats * stats);
 
 //Creates a BPS patch that converts source to target and stores it to patch. It is safe to give
 //  {NULL,0} as metadata.
 enum bpserror bps_create_linear(struct mem source, struct mem target, struct mem metadata, struct mem * patch);
+#ifdef __cplusplus
+//Same as bps_create_linear, but the patch is written to 'patch' as it's created. If that fails, it
+//  returns bps_write_failed, and whatever was written stays there.
+enum bpserror bps_create_linear_file(struct mem source, struct mem target, struct mem metadata, filewrite* patch);
+//Same as bps_create_linear_file, but reads the files a few MB at the time, so they don't need to fit in
+//  memory. The patch is the same, except where there's a long stretch where the two files have nothing
+//  in common; it may have a few more commands there.
+enum bpserror bps_create_linear_stream(file* source, file* target, struct mem metadata, filewrite* patch);
+#endif
+//How much memory bps_create_linear needs, not counting the source and target; same rules as bps_create_delta_memory.
+size_t bps_create_linear_memory(size_t sourcelen, size_t targetlen);
+//Same for bps_create_linear_stream; this one does count the files, and doesn't depend on their size.
+size_t bps_create_linear_stream_memory(size_t sourcelen, size_t targetlen);
 
 #ifdef __cplusplus // TODO: make this functionality available from C and C-ABI-only languages
 //Very similar to bps_create_linear; the difference is that this one takes longer to run, but
@@ -60,6 +98,83 @@ enum bpserror bps_create_linear(struct mem source, struct mem target, struct mem
 enum bpserror bps_create_delta(file* source, file* target, struct mem metadata, struct mem * patch,
                                bool (*progress)(void* userdata, size_t done, size_t total), void* userdata,
                                bool moremem);
+
+//Same as bps_create_delta, but the patch is written to 'patch' as it's created, in pieces of about
+//  1MB, rather than kept in memory. If writing fails, it returns bps_write_failed.
+//There are _file versions of the other delta creators too; they work the same way.
+enum bpserror bps_create_delta_file(file* source, file* target, struct mem metadata, filewrite* patch,
+                                    bool (*progress)(void* userdata, size_t done, size_t total), void* userdata,
+                                    bool moremem);
+
+//Like bps_create_delta, but instead of taking the matches as they come, it collects them all and
+//  then picks the combination that gives the smallest patch. It takes about 2-3 times as long and
+//  uses about 64*target bytes more memory, but the patches are a few percent smaller.
+enum bpserror bps_create_optimal(file* source, file* target, struct mem metadata, struct mem * patch,
+                                 bool (*progress)(void* userdata, size_t done, size_t total), void* userdata,
+                                 bool moremem);
+enum bpserror bps_create_optimal_file(file* source, file* target, struct mem metadata, filewrite* patch,
+                                      bool (*progress)(void* userdata, size_t done, size_t total), void* userdata,
+                                      bool moremem);
+
+//Much faster than bps_create_delta and uses far less memory, but only finds matches of 16 bytes or
+//  more, and may miss some of them if the table is small. The files aren't loaded; they're read a
+//  few MB at the time, so only tablesize plus about 12MB (plus the patch, unless it goes to a file)
+//  is needed, no matter how big they are. It's intended for files so big the suffix sorter can't
+//  handle them. If tablesize is 0, it picks something reasonable (at most 64MB). The progress
+//  callback works as for bps_create_delta.
+enum bpserror bps_create_hash(file* source, file* target, struct mem metadata, struct mem * patch,
+                              bool (*progress)(void* userdata, size_t done, size_t total), void* userdata,
+                              size_t tablesize);
+enum bpserror bps_create_hash_file(file* source, file* target, struct mem metadata, filewrite* patch,
+                                   bool (*progress)(void* userdata, size_t done, size_t total), void* userdata,
+                                   size_t tablesize);
+
+//Approximately how many bytes the above need, including the patch, but not the source and target
+//  files themselves; the creators read those into their own buffers. 'indexed' means
+//  bps_create_delta_indexed; the index isn't included. The sorter's own buffers and the huge page
+//  padding are counted, but thread stacks and the heap's bookkeeping aren't. The exact numbers may
+//  change in future versions, but they'll remain upper bounds for typical inputs.
+size_t bps_create_delta_memory(size_t sourcelen, size_t targetlen, bool moremem, bool indexed);
+size_t bps_create_optimal_memory(size_t sourcelen, size_t targetlen);
+//The hash creator doesn't load the files, so unlike the others, these don't depend much on their size.
+size_t bps_create_hash_memory(size_t sourcelen, size_t targetlen, size_t tablesize);
+//Same for bps_create_hash_file, where the patch isn't kept in memory.
+size_t bps_create_hash_file_memory(size_t sourcelen, size_t targetlen, size_t tablesize);
+
+//Sorts the source once and for all, so bps_create_delta_indexed can skip that part; useful if many
+//  patches are created from the same source. The output can be saved to a file and used later, but
+//  only on the same kind of machine (it's in native byte order). Free it with bps_free.
+//If 'lcp' is set, the index is about twice as big, but patch creation will be slightly faster.
+enum bpserror bps_index_create(file* source, bool lcp, struct mem * index);
+//The size of bps_index_create's output. While creating it, it also needs a copy of the source.
+size_t bps_index_memory(size_t sourcelen, bool lcp);
+
+//Same as bps_create_delta, but the source is already sorted. The patch may differ slightly from
+//  bps_create_delta's, but it's about the same size. 'index' must be from bps_index_create on the same source, or it
+//  returns bps_wrong_index; it can be a mmapped file. A damaged index is found and rejected the same way.
+enum bpserror bps_create_delta_indexed(file* source, struct mem index, file* target, struct mem metadata, struct mem * patch,
+                                       bool (*progress)(void* userdata, size_t done, size_t total), void* userdata,
+                                       bool moremem);
+enum bpserror bps_create_delta_indexed_file(file* source, struct mem index, file* target, struct mem metadata, filewrite* patch,
+                                            bool (*progress)(void* userdata, size_t done, size_t total), void* userdata,
+                                            bool moremem);
+
+//Every bps_create_delta allocates and frees several arrays the size of source+target, and the kernel
+//  has to map and clear those pages each time. If you're creating many patches, a context keeps the
+//  arrays between calls instead; they only grow, so the context ends up as big as the biggest patch
+//  needed. A context can only be used by one thread at the time. It also remembers the last source
+//  index it checked, so don't change an index in place while a context is using it.
+struct bps_delta_ctx;
+struct bps_delta_ctx* bps_delta_ctx_create();
+void bps_delta_ctx_free(struct bps_delta_ctx* ctx);
+//Same as bps_create_delta or bps_create_delta_indexed (if index.ptr isn't NULL), with a context.
+//  If 'patchfile' isn't NULL, the patch goes there like bps_create_delta_file, and 'patch' is unused.
+//'ctx' and 'stats' may be NULL. If 'stats' isn't, everything but apply is added to it; unlike the
+//  progress callback's numbers, these are measured, so use them to find out where the time goes.
+enum bpserror bps_create_delta_ctx(struct bps_delta_ctx* ctx, file* source, struct mem index, file* target, struct mem metadata,
+                                   struct mem * patch, filewrite* patchfile,
+                                   bool (*progress)(void* userdata, size_t done, size_t total), void* userdata,
+                                   bool moremem, struct bps_stats * stats);
 #endif
 
 //Like the above, but takes struct mem rather than file*. Better use the above if possible, the
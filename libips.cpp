@@ -11,8 +11,14 @@
 #endif
 #include <stdlib.h> //malloc, realloc, free
 #include <string.h> //memcpy, memset
+#include <stddef.h> //ptrdiff_t
 
 #include "libips.h"
+#include "phasetime.h"
+#include "bytecmp.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 typedef unsigned char byte;
 
@@ -20,11 +26,25 @@ typedef unsigned char byte;
 #define max(a, b) ((a)>(b) ? (a) : (b))
 #define clamp(a, b, c) max(a, min(b, c))
 
+//Both creating and applying split big files into pieces of about this size, for the threads.
+#define IPS_PIECE (256*1024)
+
+static int ips_threads(void)
+{
+	//create-many already runs one of these per thread
+#ifdef _OPENMP
+	if (!omp_in_parallel()) return omp_get_max_threads();
+#endif
+	return 1;
+}
+
 struct ipsstudy {
 	enum ipserror error;
 	unsigned int outlen_min;
 	unsigned int outlen_max;
 	unsigned int outlen_min_mem;
+	unsigned int numrecords;
+	bool sorted; // the records are in order and don't overlap, so they don't need sorting
 };
 
 enum ipserror ips_study(struct mem patch, struct ipsstudy * study)
@@ -50,6 +70,8 @@ enum ipserror ips_study(struct mem patch, struct ipsstudy * study)
 	unsigned int thisout = 0;
 	//unsigned int lastoffset = 0;
 	bool w_scrambled = false;
+	study->numrecords = 0;
+	study->sorted = true;
 	while (offset != 0x454F46) // 454F46=EOF
 	{
 		unsigned int size = read16();
@@ -68,7 +90,9 @@ enum ipserror ips_study(struct mem patch, struct ipsstudy * study)
 		//turns out this messes up manually created patches. https://github.com/Alcaro/Flips/issues/13
 		//if (offset < lastoffset) w_scrambled = true;
 		//lastoffset = offset;
+		if (offset < outlen) study->sorted = false;
 		if (thisout > outlen) outlen = thisout;
+		study->numrecords++;
 		if (patchat >= patchend) return ips_invalid;
 		offset = read24();
 	}
@@ -94,72 +118,278 @@ enum ipserror ips_study(struct mem patch, struct ipsstudy * study)
 	return study->error;
 }
 
-enum ipserror ips_apply_study(struct mem patch, struct ipsstudy * study, struct mem in, struct mem * out)
+//One record of a patch, as kept in an ips_index.
+struct ips_record {
+	unsigned int offset;
+	unsigned int size;
+	unsigned int data; // where the data starts in the patch; for RLE records, where the byte is
+	bool rle;
+	bool grouped; // overlaps a record earlier in the index, so this one must be applied after that
+};
+
+struct ips_index {
+	struct ipsstudy study;
+	struct mem patch;
+	
+	//Sorted by offset, except that records that overlap are kept together in a group, in the order
+	// they're in the patch; applying them in this order does the same as applying them in patch order.
+	struct ips_record * records;
+	
+	size_t plain_records;
+	size_t plain_bytes;
+	size_t rle_records;
+	size_t rle_bytes;
+};
+
+static int ips_record_offset_order(const void * left, const void * right)
+{
+	const struct ips_record * a = (const struct ips_record*)left;
+	const struct ips_record * b = (const struct ips_record*)right;
+	if (a->offset != b->offset) return (a->offset < b->offset ? -1 : 1);
+	return (a->data < b->data ? -1 : a->data > b->data);
+}
+
+static int ips_record_patch_order(const void * left, const void * right)
+{
+	const struct ips_record * a = (const struct ips_record*)left;
+	const struct ips_record * b = (const struct ips_record*)right;
+	return (a->data < b->data ? -1 : a->data > b->data);
+}
+
+//Lists the records of a patch that ips_study accepted.
+static void ips_index_records(struct ips_index * index)
+{
+	unsigned int numrecords = index->study.numrecords;
+	struct ips_record * records = (struct ips_record*)malloc(sizeof(struct ips_record)*max(numrecords, 1));
+	index->records = records;
+	index->plain_records = 0;
+	index->plain_bytes = 0;
+	index->rle_records = 0;
+	index->rle_bytes = 0;
+	
+	const unsigned char * patchstart = index->patch.ptr;
+	const unsigned char * patchat = patchstart+5;
+	//guaranteed to not overflow at this point, we already checked the patch
+#define read16() (patchat += 2,(                      (patchat[-2] << 8) | patchat[-1]))
+#define read24() (patchat += 3,((patchat[-3] << 16) | (patchat[-2] << 8) | patchat[-1]))
+	for (unsigned int i=0;i<numrecords;i++)
+	{
+		records[i].offset = read24();
+		records[i].size = read16();
+		records[i].rle = (records[i].size == 0);
+		records[i].grouped = false;
+		if (records[i].rle)
+		{
+			records[i].size = read16();
+			records[i].data = patchat - patchstart;
+			patchat++;
+			index->rle_records++;
+			index->rle_bytes += records[i].size;
+		}
+		else
+		{
+			records[i].data = patchat - patchstart;
+			patchat += records[i].size;
+			index->plain_records++;
+			index->plain_bytes += records[i].size;
+		}
+	}
+#undef read16
+#undef read24
+	if (index->study.sorted) return;
+	
+	qsort(records, numrecords, sizeof(struct ips_record), ips_record_offset_order);
+	unsigned int groupstart = 0;
+	unsigned int groupend = 0;
+	for (unsigned int i=0;i<=numrecords;i++)
+	{
+		if (i < numrecords && i > 0 && records[i].offset < groupend)
+		{
+			records[i].grouped = true;
+		}
+		else
+		{
+			if (i - groupstart > 1)
+				qsort(records + groupstart, i - groupstart, sizeof(struct ips_record), ips_record_patch_order);
+			//the first one in patch order may not be the first by offset, but the group is applied as one
+			for (unsigned int j=groupstart;j<i;j++) records[j].grouped = (j != groupstart);
+			groupstart = i;
+		}
+		if (i < numrecords) groupend = max(groupend, records[i].offset + records[i].size);
+	}
+}
+
+//Returns whether a record changes anything in the input. 'data' is NULL for RLE records.
+//Until something is changed, the output is the same as the input, so it doesn't matter whether that's
+// been copied yet.
+static bool ips_record_changes(struct mem in, unsigned int offset, const byte * data, byte b, unsigned int size)
+{
+	if (offset >= in.len) return false; // anything past the input is truncated, or it'd have changed size
+	unsigned int n = min(size, in.len - offset);
+	if (data) return (bytecmp_len(in.ptr + offset, data, n) != n);
+	else return (in.ptr[offset] != b || bytecmp_len(in.ptr + offset, in.ptr + offset + 1, n - 1) != n - 1);
+}
+
+//Applies records [first, last), and copies the input to everything else between 'start' and 'end'.
+//Only the gaps between records are copied, so every output byte is written once, except where records
+// overlap. Returns whether anything was changed from the input; if 'anychanges' is set, that's already
+// known, and the records aren't checked.
+static bool ips_apply_records(const struct ips_index * index, unsigned int first, unsigned int last,
+                              struct mem in, byte * out, unsigned int outlen, unsigned int start, unsigned int end, bool anychanges)
+{
+	const byte * patch = index->patch.ptr;
+	unsigned int copied = start;
+	for (unsigned int i=first;i<last;i++)
+	{
+		const struct ips_record * record = &index->records[i];
+		const byte * data = patch + record->data;
+		if (!anychanges && ips_record_changes(in, record->offset, record->rle ? NULL : data, *data, record->size))
+			anychanges = true;
+		
+		if (copied < record->offset) bytecmp_copy_input(out, in.ptr, in.len, outlen, copied, record->offset);
+		if (record->rle) memset(out + record->offset, *data, record->size);
+		else memcpy(out + record->offset, data, record->size);
+		copied = max(copied, record->offset + record->size);
+	}
+	bytecmp_copy_input(out, in.ptr, in.len, outlen, copied, end);
+	return anychanges;
+}
+
+static enum ipserror ips_apply_index_stats(const struct ips_index * index, struct mem in, struct mem * out,
+                                           struct ips_stats * stats, struct phasetime_clock * clock)
 {
+	const struct ipsstudy * study = &index->study;
 	out->ptr = NULL;
 	out->len = 0;
 	if (study->error == ips_invalid) return study->error;
-#define read8() (*patchat++)//guaranteed to not overflow at this point, we already checked the patch
-#define read16() (patchat += 2,(                      (patchat[-2] << 8) | patchat[-1]))
-#define read24() (patchat += 3,((patchat[-3] << 16) | (patchat[-2] << 8) | patchat[-1]))
+	enum ipserror error = study->error;
 	unsigned int outlen = clamp(study->outlen_min, in.len, study->outlen_max);
 	out->ptr = (byte*)malloc(max(outlen, study->outlen_min_mem));
 	out->len = outlen;
 	
-	bool anychanges = false;
-	if (outlen != in.len) anychanges = true;
+	bool sizechanged = (outlen != in.len);
 	
-	if (out->len > in.len)
+	//big files are split into parts, each done on its own thread; a part can't start inside a group
+	unsigned int numrecords = study->numrecords;
+	unsigned int maxparts = min(outlen/IPS_PIECE, (unsigned int)ips_threads()*4);
+	if (maxparts < 1) maxparts = 1;
+	unsigned int * partfirst = (unsigned int*)malloc(sizeof(unsigned int)*(maxparts+1));
+	unsigned int * partstart = (unsigned int*)malloc(sizeof(unsigned int)*(maxparts+1));
+	unsigned int numparts = 1;
+	partfirst[0] = 0;
+	partstart[0] = 0;
+	unsigned int i = 0;
+	for (unsigned int part=1;part<maxparts;part++)
 	{
-		memcpy(out->ptr, in.ptr, in.len);
-		memset(out->ptr + in.len, 0, out->len - in.len);
+		unsigned int want = outlen/maxparts*part;
+		while (i < numrecords && (index->records[i].offset < want || index->records[i].grouped)) i++;
+		if (i == numrecords) break;
+		if (i == partfirst[numparts-1]) continue;
+		//the group starts where its lowest record does
+		unsigned int start = index->records[i].offset;
+		for (unsigned int j=i+1;j<numrecords && index->records[j].grouped;j++)
+			start = min(start, index->records[j].offset);
+		partfirst[numparts] = i;
+		partstart[numparts] = start;
+		numparts++;
 	}
-	else memcpy(out->ptr, in.ptr, outlen);
+	partfirst[numparts] = numrecords;
+	partstart[numparts] = outlen;
 	
-	const unsigned char * patchat = patch.ptr+5;
-	unsigned int offset = read24();
-	while (offset != 0x454F46)
+	bool anychanges = sizechanged;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) reduction(||:anychanges)
+#endif
+	for (ptrdiff_t part=0;part<(ptrdiff_t)numparts;part++)
 	{
-		unsigned int size = read16();
-		if (size == 0)
-		{
-			size = read16();
-			//if (!size) return ips_invalid; // rejected in ips_study
-			unsigned char b = read8();
-			
-			if (!anychanges && size && (out->ptr[offset] != b || memcmp(out->ptr + offset, out->ptr + offset, size - 1)))
-				anychanges = true;
-			
-			memset(out->ptr + offset, b, size);
-		}
-		else
-		{
-			if (!anychanges && memcmp(out->ptr + offset, patchat, size))
-				anychanges = true;
-			
-			memcpy(out->ptr + offset, patchat, size);
-			patchat += size;
-		}
-		offset = read24();
+		if (ips_apply_records(index, partfirst[part], partfirst[part+1], in, out->ptr, outlen,
+		                      partstart[part], partstart[part+1], sizechanged))
+			anychanges = true;
+	}
+	free(partfirst);
+	free(partstart);
+	phasetime_lap(clock, stats ? &stats->apply : NULL);
+	if (stats)
+	{
+		stats->records += index->plain_records;
+		stats->record_bytes += index->plain_bytes;
+		stats->rle_records += index->rle_records;
+		stats->rle_bytes += index->rle_bytes;
 	}
-#undef read8
-#undef read16
-#undef read24
 	
 	//truncate data without this being needed is a poor idea
 	if (study->outlen_max != 0xFFFFFFFF && in.len <= study->outlen_max)
-		study->error = ips_notthis;
+		error = ips_notthis;
 	
 	if (!anychanges)
-		study->error = ips_thisout;
+		error = ips_thisout;
+	return error;
+}
+
+enum ipserror ips_apply_study(struct mem patch, struct ipsstudy * study, struct mem in, struct mem * out)
+{
+	if (study->error == ips_invalid)
+	{
+		out->ptr = NULL;
+		out->len = 0;
+		return study->error;
+	}
+	struct ips_index index;
+	index.study = *study;
+	index.patch = patch;
+	ips_index_records(&index);
+	study->error = ips_apply_index_stats(&index, in, out, NULL, NULL);
+	free(index.records);
 	return study->error;
 }
 
+enum ipserror ips_apply_stats(struct mem patch, struct mem in, struct mem * out, struct ips_stats * stats)
+{
+	struct phasetime_clock clock = { 0, 0 };
+	if (stats) phasetime_start(&clock);
+	struct ips_index index;
+	index.patch = patch;
+	index.records = NULL;
+	if (ips_study(patch, &index.study) != ips_invalid) ips_index_records(&index);
+	phasetime_lap(&clock, stats ? &stats->study : NULL);
+	enum ipserror error = ips_apply_index_stats(&index, in, out, stats, &clock);
+	free(index.records);
+	return error;
+}
+
 enum ipserror ips_apply(struct mem patch, struct mem in, struct mem * out)
 {
-	struct ipsstudy study;
-	ips_study(patch, &study);
-	return ips_apply_study(patch, &study, in, out);
+	return ips_apply_stats(patch, in, out, NULL);
+}
+
+enum ipserror ips_index_create(struct mem patch, struct ips_index * * index)
+{
+	*index = NULL;
+	struct ips_index * ret = (struct ips_index*)malloc(sizeof(struct ips_index));
+	if (ips_study(patch, &ret->study) == ips_invalid)
+	{
+		free(ret);
+		return ips_invalid;
+	}
+	ret->patch.ptr = (byte*)malloc(patch.len);
+	ret->patch.len = patch.len;
+	memcpy(ret->patch.ptr, patch.ptr, patch.len);
+	ips_index_records(ret);
+	*index = ret;
+	return ret->study.error;
+}
+
+enum ipserror ips_apply_index(const struct ips_index * index, struct mem in, struct mem * out)
+{
+	return ips_apply_index_stats(index, in, out, NULL, NULL);
+}
+
+void ips_index_free(struct ips_index * index)
+{
+	if (!index) return;
+	free(index->patch.ptr);
+	free(index->records);
+	free(index);
 }
 
 //Known situations where this function does not generate an optimal patch:
@@ -189,58 +419,92 @@ enum ipserror ips_apply(struct mem patch, struct mem in, struct mem * out)
 
 //There are no known cases where LIPS wins over libips.
 
-enum ipserror ips_create(struct mem sourcemem, struct mem targetmem, struct mem * patchmem)
-{
-	unsigned int sourcelen = sourcemem.len;
-	unsigned int targetlen = targetmem.len;
-	const unsigned char * source = sourcemem.ptr;
-	const unsigned char * target = targetmem.ptr;
-	
-	patchmem->ptr = NULL;
-	patchmem->len = 0;
-	
-	if (targetlen > 16777216) return ips_16MB;
-	if (targetlen >= 16777216 && sourcelen > targetlen) return ips_16MB; // can't truncate to exactly 16MB
+//Where one piece of the target ends and the next starts. The records are written out in this order.
+struct ips_piece {
+	unsigned int start;
+	unsigned int end;
 	
-	unsigned int offset = 0;
-	unsigned int outbuflen = 4096;
-	unsigned char * out = (byte*)malloc(outbuflen);
-	unsigned int outlen = 0;
-#define write8(val) do { \
-		out[outlen++] = (val); \
-		if (outlen == outbuflen) { outbuflen *= 2; out = (byte*)realloc(out, outbuflen); } \
+	byte * out;
+	unsigned int outlen;
+};
+
+//The pieces can be encoded on their own if no record would have crossed the seam between them. That's
+// true if the seam has six unchanged bytes right before it, so the search for the end of a block stops
+// there, is unchanged itself, and the target byte before it is different, so an RLE can't run over it.
+//Returns the first such seam between 'start' and 'end', or 0 if there is none.
+static unsigned int ips_find_seam(const byte * source, const byte * target, unsigned int start, unsigned int end)
+{
+	unsigned int i = start;
+	while (i + 7 <= end)
+	{
+		i += bytecmp_find_run(source + i, target + i, end - i, 7);
+		if (i + 7 > end) break;
+		unsigned int same = i + bytecmp_len(source + i, target + i, end - i);
+		unsigned int at = i + 6;
+		at += bytecmp_len(target + at - 1, target + at, same - at);
+		if (at < same) return at;
+		i = same;
+	}
+	return 0;
+}
+
+//All of these need 'out', 'outlen' and 'outbuflen', and a makeroom() that's called whenever out is full.
+#define write8(val) do { out[outlen++] = (val); makeroom(); } while(0)
+#define writemem(ptr, len) do { \
+		const byte * tmpptr = (ptr); \
+		unsigned int tmplen = (len); \
+		while (tmplen) { \
+			unsigned int n = min(tmplen, outbuflen - outlen); \
+			memcpy(out + outlen, tmpptr, n); \
+			outlen += n; \
+			tmpptr += n; \
+			tmplen -= n; \
+			makeroom(); \
+		} \
 		} while(0)
 #define write16(val) do {                      write8((val) >> 8); write8((val)); } while(0)
 #define write24(val) do { write8((val) >> 16); write8((val) >> 8); write8((val)); } while(0)
-	write8('P');
-	write8('A');
-	write8('T');
-	write8('C');
-	write8('H');
+
+//Creates the records for the target between piece->start and piece->end. The end of the piece works
+// just like the end of the target would; ips_find_seam makes sure no record would have crossed it.
+static void ips_create_piece(const byte * source, unsigned int sourcelen, const byte * target, struct ips_piece * piece)
+{
+	unsigned int end = piece->end;
+	unsigned int outbuflen = 4096;
+	unsigned char * out = (byte*)malloc(outbuflen);
+	unsigned int outlen = 0;
+#define makeroom() do { if (outlen == outbuflen) { outbuflen *= 2; out = (byte*)realloc(out, outbuflen); } } while(0)
+	//bytes past the end of either file, or the piece, always count as changed
+	unsigned int offset = piece->start;
+	unsigned int cmplen = min(sourcelen, end);
 	int lastknownchange = 0;
 	//int forcewrite = (targetlen > sourcelen ? 1 : 0);
-	while (offset < targetlen)
+	while (offset < end)
 	{
-		while (offset < sourcelen && (offset < sourcelen ? source[offset] : 0) == target[offset])
-			offset++;
+		if (offset < cmplen) offset += bytecmp_len(source + offset, target + offset, cmplen - offset);
 		//check how much we need to edit until it starts getting similar
-		int thislen = 0;
-		int consecutiveunchanged = 0;
-		thislen = lastknownchange - offset;
+		//this used to be a byte at the time loop; it ends the block at the first six unchanged bytes in a
+		// row, or at the first changed byte that makes the block 64KB, whichever comes first
+		int thislen = lastknownchange - offset;
 		if (thislen < 0) thislen = 0;
-		while (true)
+		unsigned int scan = offset + thislen;
+		if (thislen >= 65536)
 		{
-			unsigned int thisbyte = offset + thislen + consecutiveunchanged;
-			if (thisbyte < sourcelen && (thisbyte < sourcelen ? source[thisbyte] : 0) == target[thisbyte])
-			{
-				consecutiveunchanged++;
-			}
+			//the old loop always looked at one byte before checking the length
+			if (!(scan < cmplen && source[scan] == target[scan])) thislen++;
+		}
+		else
+		{
+			unsigned int lastchange = offset + 65535;
+			unsigned int runend = min(cmplen, lastchange + 6);
+			unsigned int run = (scan < runend ? scan + bytecmp_find_run(source + scan, target + scan, runend - scan, 6) : runend);
+			if (run < runend) thislen = run - offset;
 			else
 			{
-				thislen += consecutiveunchanged + 1;
-				consecutiveunchanged = 0;
+				unsigned int changed = max(scan, lastchange);
+				if (changed < cmplen) changed += bytecmp_len(source + changed, target + changed, cmplen - changed);
+				thislen = changed - offset + 1;
 			}
-			if (consecutiveunchanged >= 6 || thislen >= 65536) break;
 		}
 		
 		//avoid premature EOF
@@ -252,29 +516,34 @@ enum ipserror ips_create(struct mem sourcemem, struct mem targetmem, struct mem
 		
 		lastknownchange = offset + thislen;
 		if (thislen > 65535) thislen = 65535;
-		if (offset + thislen > targetlen) thislen = targetlen - offset;
-		if (offset == targetlen) continue;
+		if (offset + thislen > end) thislen = end - offset;
+		if (offset == end) continue;
 		
 		//check if RLE here is worthwhile
-		int byteshere;
-		for (byteshere=0; byteshere<thislen && target[offset] == target[offset+byteshere]; byteshere++) {}
+		int byteshere = (thislen ? 1 + bytecmp_len(&target[offset], &target[offset + 1], thislen - 1) : 0);
 		if (byteshere == thislen)
 		{
+			//extend the RLE up to the last changed byte before the value changes
 			int thisbyte = target[offset];
-			int i = 0;
-			while (true)
+			unsigned int pos = offset + byteshere - 1;
+			unsigned int runend = pos;
+			unsigned int runmax = min(end, offset + 65535);
+			if (pos < runmax && target[pos] == thisbyte)
+				runend = pos + 1 + bytecmp_len(&target[pos], &target[pos + 1], runmax - pos - 1);
+			unsigned int lastchanged = pos;
+			if (runend > pos && runend > sourcelen) lastchanged = runend - 1;
+			else
 			{
-				unsigned int pos = offset + byteshere + i - 1;
-				if (pos >= targetlen || target[pos] != thisbyte || byteshere + i > 65535)
-					break;
-				if (pos >= sourcelen || (pos < sourcelen ? source[pos] : 0) != thisbyte)
+				//the target is 'thisbyte' all the way, so it's changed wherever source and target differ
+				unsigned int i = pos;
+				while (i < runend)
 				{
-					byteshere += i;
-					thislen += i;
-					i = 0;
+					i += bytecmp_len(&source[i], &target[i], runend - i);
+					if (i < runend) lastchanged = i++;
 				}
-				i++;
 			}
+			thislen += lastchanged - pos;
+			byteshere += lastchanged - pos;
 		}
 		if ((byteshere > 8-5 && byteshere == thislen) || byteshere > 8)
 		{
@@ -287,19 +556,17 @@ enum ipserror ips_create(struct mem sourcemem, struct mem targetmem, struct mem
 		else
 		{
 			//check if we'd gain anything from ending the block early and switching to RLE
-			int byteshere = 0;
+			//only runs of more than 8 equal bytes can pass the tests below, so skip to the next one of those,
+			// then back to where that run starts
 			int stopat = 0;
-			while (stopat + byteshere < thislen)
+			while (stopat < thislen)
 			{
-				if (target[offset + stopat] == target[offset + stopat + byteshere])
-				{
-					byteshere++;
-				}
-				else
-				{
-					stopat += byteshere;
-					byteshere = 0;
-				}
+				const byte * here = &target[offset + stopat];
+				int next = bytecmp_find_run(here, here + 1, thislen - stopat - 1, 8);
+				if (next == thislen - stopat - 1) break;
+				while (next > 0 && here[next - 1] == here[next]) next--;
+				stopat += next;
+				int byteshere = 1 + bytecmp_len(&target[offset + stopat], &target[offset + stopat + 1], thislen - stopat - 1);
 				if (byteshere > 8+5 || //rle-worthy despite two ips headers
 				   (byteshere > 8 && stopat + byteshere == thislen) || //rle-worthy at end of data
 				   (byteshere > 8 && !memcmp(&target[offset +stopat + byteshere], //rle-worthy before another rle-worthy
@@ -309,9 +576,10 @@ enum ipserror ips_create(struct mem sourcemem, struct mem targetmem, struct mem
 					if (stopat) thislen = stopat;
 					break; //we don't scan the entire block if we know we'll want to RLE, that'd gain nothing.
 				}
+				stopat += byteshere;
 			}
 			//don't write unchanged bytes at the end of a block if we want to RLE the next couple of bytes
-			if (offset + thislen != targetlen)
+			if (offset + thislen != end)
 			{
 				while (offset + thislen - 1 < sourcelen &&
 				       target[offset + thislen - 1] == (offset + thislen - 1 < sourcelen ? source[offset + thislen - 1] : 0))
@@ -331,24 +599,134 @@ enum ipserror ips_create(struct mem sourcemem, struct mem targetmem, struct mem
 			{
 				write24(offset);
 				write16(thislen);
-				int i;
-				for (i=0; i<thislen; i++)
-					write8(target[offset + i]);
+				writemem(&target[offset], thislen);
 			}
 			offset += thislen;
 		}
 	}
+#undef makeroom
+	piece->out = out;
+	piece->outlen = outlen;
+}
+
+//If 'sink' is set, the patch is sent there in pieces rather than returned in patchmem.
+static enum ipserror ips_create_main(struct mem sourcemem, struct mem targetmem, struct mem * patchmem,
+                                     bool (*sink)(void* userdata, const uint8_t* data, size_t len), void* userdata)
+{
+	unsigned int sourcelen = sourcemem.len;
+	unsigned int targetlen = targetmem.len;
+	const unsigned char * source = sourcemem.ptr;
+	const unsigned char * target = targetmem.ptr;
+	
+	if (patchmem)
+	{
+		patchmem->ptr = NULL;
+		patchmem->len = 0;
+	}
+	
+	if (targetlen > 16777216) return ips_16MB;
+	if (targetlen >= 16777216 && sourcelen > targetlen) return ips_16MB; // can't truncate to exactly 16MB
+	
+	//the records are independent, so the target is split into pieces that are done on all threads
+	unsigned int cmplen = min(sourcelen, targetlen);
+	unsigned int numstretches = targetlen/IPS_PIECE + 1;
+	unsigned int * seams = (unsigned int*)malloc(sizeof(unsigned int)*(numstretches+1));
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (ptrdiff_t i=1;i<(ptrdiff_t)numstretches;i++)
+	{
+		seams[i] = ips_find_seam(source, target, i*IPS_PIECE, min((i+1)*IPS_PIECE, cmplen));
+	}
+	//a stretch without a seam is joined to the previous piece
+	unsigned int numpieces = 1;
+	seams[0] = 0;
+	for (unsigned int i=1;i<numstretches;i++)
+	{
+		if (seams[i]) seams[numpieces++] = seams[i];
+	}
+	seams[numpieces] = targetlen;
+	
+	unsigned int batch = ips_threads()*2;
+	struct ips_piece * pieces = (struct ips_piece*)malloc(sizeof(struct ips_piece)*batch);
+	
+	unsigned int outbuflen = (sink ? 65536 : 4096);
+	unsigned char * out = (byte*)malloc(outbuflen);
+	unsigned int outlen = 0;
+	unsigned int sentlen = 0;
+	bool sinkok = true;
+#define makeroom() do { \
+		if (outlen == outbuflen) { \
+			if (sink) { sinkok &= sink(userdata, out, outlen); sentlen += outlen; outlen = 0; } \
+			else { outbuflen *= 2; out = (byte*)realloc(out, outbuflen); } \
+		} \
+		} while(0)
+	write8('P');
+	write8('A');
+	write8('T');
+	write8('C');
+	write8('H');
+	for (unsigned int first=0;first<numpieces;first+=batch)
+	{
+		unsigned int n = min(batch, numpieces-first);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+		for (ptrdiff_t i=0;i<(ptrdiff_t)n;i++)
+		{
+			pieces[i].start = seams[first+i];
+			pieces[i].end = seams[first+i+1];
+			ips_create_piece(source, sourcelen, target, &pieces[i]);
+		}
+		for (unsigned int i=0;i<n;i++)
+		{
+			writemem(pieces[i].out, pieces[i].outlen);
+			free(pieces[i].out);
+		}
+	}
+	free(pieces);
+	free(seams);
 	write8('E');
 	write8('O');
 	write8('F');
 	if (sourcelen > targetlen) write24(targetlen);
-#undef write
-	patchmem->ptr = out;
-	patchmem->len = outlen;
-	if (outlen == 8)
+#undef makeroom
+	if (sink)
+	{
+		sinkok &= sink(userdata, out, outlen);
+		free(out);
+		if (!sinkok) return ips_write_failed;
+	}
+	else
+	{
+		patchmem->ptr = out;
+		patchmem->len = outlen;
+	}
+	if (sentlen + outlen == 8)
 		return ips_identical;
 	return ips_ok;
 }
+#undef write8
+#undef write16
+#undef write24
+#undef writemem
+
+enum ipserror ips_create(struct mem sourcemem, struct mem targetmem, struct mem * patchmem)
+{
+	return ips_create_main(sourcemem, targetmem, patchmem, NULL, NULL);
+}
+
+#ifdef __cplusplus
+static bool ips_sink_filewrite(void* userdata, const uint8_t* data, size_t len)
+{
+	return ((filewrite*)userdata)->append(data, len);
+}
+
+enum ipserror ips_create_file(struct mem sourcemem, struct mem targetmem, filewrite* patch)
+{
+	return ips_create_main(sourcemem, targetmem, NULL, ips_sink_filewrite, patch);
+}
+#endif
 
 void ips_free(struct mem mem)
 {
@@ -20,6 +20,7 @@ enum ipserror {
 	ips_16MB,//One or both files is bigger than 16MB. The IPS format doesn't support that. The created
 	         //patch contains only the differences to that point.
 	ips_identical,//The input buffers are identical.
+	ips_write_failed,//The patch couldn't be written to the given filewrite.
 	
 	ips_shut_up_gcc//This one isn't used, it's just to kill a stray comma warning.
 };
@@ -28,8 +29,25 @@ enum ipserror {
 //  return value in out to ips_free when you're done with it.
 enum ipserror ips_apply(struct mem patch, struct mem in, struct mem * out);
 
+//Like bps_stats. Everything is added to what's already there; memset it to zero first.
+struct ips_stats {
+	struct phase_time study; //Parsing and validating the patch, and sorting the records.
+	struct phase_time apply; //Running the records, and copying the input to the gaps between them.
+	
+	size_t records;      //Plain records, and how many bytes they write.
+	size_t record_bytes;
+	size_t rle_records;  //Same for RLE records.
+	size_t rle_bytes;
+};
+//Same as ips_apply, but also fills in 'stats' (if not NULL).
+enum ipserror ips_apply_stats(struct mem patch, struct mem in, struct mem * out, struct ips_stats * stats);
+
 //Creates an IPS patch that converts source to target and stores it to patch.
 enum ipserror ips_create(struct mem source, struct mem target, struct mem * patch);
+#ifdef __cplusplus
+//Same as ips_create, but the patch is written to 'patch' as it's created.
+enum ipserror ips_create_file(struct mem source, struct mem target, filewrite* patch);
+#endif
 
 //Frees the memory returned in the output parameters of the above. Do not call it twice on the same
 //  input, nor on anything you got from anywhere else. ips_free is guaranteed to be equivalent to
@@ -44,6 +62,15 @@ struct ipsstudy;
 enum ipserror ips_study(struct mem patch, struct ipsstudy * study);
 enum ipserror ips_apply_study(struct mem patch, struct ipsstudy * study, struct mem in, struct mem * out);
 
+//An ips_index is the records of a patch, parsed, checked and sorted, so it can be applied to many ROMs
+//  without doing that every time. It keeps its own copy of the patch. ips_index_create returns the
+//  same as ips_study, and the index is NULL if the patch is invalid.
+//ips_apply_index is the same as ips_apply, and can be called on the same index from several threads.
+struct ips_index;
+enum ipserror ips_index_create(struct mem patch, struct ips_index * * index);
+enum ipserror ips_apply_index(const struct ips_index * index, struct mem in, struct mem * out);
+void ips_index_free(struct ips_index * index);
+
 #ifdef __cplusplus
 }
 #endif
@@ -15,6 +15,7 @@
 #include <stdlib.h>//malloc, realloc, free
 #include <string.h>//memcpy, memset
 #include "crc32.h"
+#include "bytecmp.h"
 
 static uint32_t read32(uint8_t * ptr)
 {
@@ -26,6 +27,50 @@ static uint32_t read32(uint8_t * ptr)
 	return out;
 }
 
+static void ups_xor(uint8_t * out, const uint8_t * a, const uint8_t * b, size_t len)
+{
+	size_t i=0;
+#ifdef BYTECMP_SSE2
+	for (;i+16<=len;i+=16)
+	{
+		__m128i x=_mm_loadu_si128((const __m128i*)(a+i));
+		__m128i y=_mm_loadu_si128((const __m128i*)(b+i));
+		_mm_storeu_si128((__m128i*)(out+i), _mm_xor_si128(x, y));
+	}
+#endif
+	for (;i<len;i++) out[i]=a[i]^b[i];
+}
+
+//Checks the checksums at the end of the patch, which 'trailer' points to, against the files. If they're
+// the same size, the patch can't tell which way it's applied, so either order is fine.
+static enum upserror ups_check_crcs(const uint8_t * trailer, bool samesize, bool backwards,
+                                    uint32_t crc_in, uint32_t crc_out, uint32_t crc_patch)
+{
+	uint32_t crc_in_expected=read32((uint8_t*)trailer);
+	uint32_t crc_out_expected=read32((uint8_t*)trailer+4);
+	uint32_t crc_patch_expected=read32((uint8_t*)trailer+8);
+	
+	if (samesize)
+	{
+		if ((crc_in!=crc_in_expected || crc_out!=crc_out_expected) && (crc_in!=crc_out_expected || crc_out!=crc_in_expected)) return ups_not_this;
+	}
+	else
+	{
+		if (!backwards)
+		{
+			if (crc_in!=crc_in_expected) return ups_not_this;
+			if (crc_out!=crc_out_expected) return ups_not_this;
+		}
+		else
+		{
+			if (crc_in!=crc_out_expected) return ups_not_this;
+			if (crc_out!=crc_in_expected) return ups_not_this;
+		}
+	}
+	if (crc_patch!=crc_patch_expected) return ups_broken;
+	return ups_ok;
+}
+
 #define error(which) do { error=which; goto exit; } while(0)
 #define assert_sum(a,b) do { if (SIZE_MAX-(a)<(b)) error(ups_too_big); } while(0)
 #define assert_shift(a,b) do { if (SIZE_MAX>>(b)<(a)) error(ups_too_big); } while(0)
@@ -39,8 +84,6 @@ enum upserror ups_apply(struct mem patch, struct mem in, struct mem * out)
 	if (true)
 	{
 #define readpatch8() (*(patchat++))
-#define readin8() (*(inat++))
-#define writeout8(byte) (*(outat++)=byte)
 		
 #define decodeto(var) \
 				do { \
@@ -48,6 +91,7 @@ enum upserror ups_apply(struct mem patch, struct mem in, struct mem * out)
 					unsigned int shift=0; \
 					while (true) \
 					{ \
+						if (patchat==patchend) error(ups_broken); \
 						uint8_t next=readpatch8(); \
 						assert_shift(next&0x7F, shift); \
 						size_t addthis=(next&0x7F)<<shift; \
@@ -84,94 +128,464 @@ enum upserror ups_apply(struct mem patch, struct mem in, struct mem * out)
 		if (inlen!=in.len) error(ups_not_this);
 		
 		out->len=outlen;
-		out->ptr=(uint8_t*)malloc(outlen);
-		memset(out->ptr, 0, outlen);
-		
-		//uint8_t * instart=in.ptr;
-		uint8_t * inat=in.ptr;
-		uint8_t * inend=in.ptr+in.len;
-		
-		//uint8_t * outstart=out->ptr;
-		uint8_t * outat=out->ptr;
-		uint8_t * outend=out->ptr+out->len;
+		out->ptr=(uint8_t*)malloc(outlen ? outlen : 1);
+		if (!out->ptr) error(ups_out_of_mem);
 		
+		//input and output are at the same position all the time; skipped bytes and the terminators are
+		// copied from the input when the next run is found, the rest is XORed straight from the patch
+		size_t pos=0;
+		size_t copied=0;
 		while (patchat<patchend)
 		{
 			size_t skip;
 			decodeto(skip);
-			while (skip>0)
-			{
-				uint8_t out;
-				if (inat>=inend) out=0;
-				else out=readin8();
-				if (outat<outend) writeout8(out);
-				skip--;
-			}
-			uint8_t tmp;
-			do
+			assert_sum(pos, skip);
+			pos+=skip;
+			
+			const uint8_t * term=(const uint8_t*)memchr(patchat, 0, patchend-patchat);
+			if (!term) error(ups_broken);
+			size_t len=term-patchat;
+			if (pos<outlen)
 			{
-				tmp=readpatch8();
-				uint8_t out;
-				if (inat>=inend) out=0;
-				else out=readin8();
-				if (outat<outend) writeout8(out^tmp);
+				bytecmp_copy_input(out->ptr, in.ptr, in.len, outlen, copied, pos);
+				size_t n=(len<outlen-pos ? len : outlen-pos);
+				size_t nxor=(pos<in.len ? in.len-pos : 0);
+				if (nxor>n) nxor=n;
+				ups_xor(out->ptr+pos, in.ptr+pos, patchat, nxor);
+				memcpy(out->ptr+pos+nxor, patchat+nxor, n-nxor);
+				copied=pos+n;
 			}
-			while (tmp);
-		}
-		if (patchat!=patchend) error(ups_broken);
-		while (outat<outend && inat<inend)
-		{
-			writeout8(readin8());
+			assert_sum(pos, len+1);
+			pos+=len+1;
+			patchat+=len+1;
 		}
-		while (outat<outend) writeout8(0);
-		while (inat<inend) (void)readin8();
-		
-		uint32_t crc_in_expected=read32(patchat);
-		uint32_t crc_out_expected=read32(patchat+4);
-		uint32_t crc_patch_expected=read32(patchat+8);
+		bytecmp_copy_input(out->ptr, in.ptr, in.len, outlen, copied, outlen);
 		
 		uint32_t crc_in=crc32(in.ptr, in.len);
 		uint32_t crc_out=crc32(out->ptr, out->len);
 		uint32_t crc_patch=crc32(patch.ptr, patch.len-4);
+		enum upserror crcerror=ups_check_crcs(patchat, inlen==outlen, backwards, crc_in, crc_out, crc_patch);
+		if (crcerror!=ups_ok) error(crcerror);
+		return ups_ok;
+#undef readpatch8
+#undef decodeto
+	}
+	
+exit:
+	free(out->ptr);
+	out->len=0;
+	out->ptr=NULL;
+	return error;
+}
+
+#ifdef __cplusplus
+//ups_apply_file reads and writes this much of each file at the time.
+#define UPS_WINDOW (1024*1024)
+
+//The part of the patch between the header and the checksums, read a window at the time.
+struct ups_patch_reader {
+	file* f;
+	size_t end;
+	size_t bufstart; // where buf is in the file
+	size_t buflen;
+	size_t at;
+	uint8_t * buf;
+	uint32_t crc; // of everything before buf
+	bool ioerror;
+};
+
+//Reads the next window. Returns false at the end of the patch, or if it can't be read.
+static bool ups_patch_fill(struct ups_patch_reader * r)
+{
+	if (r->bufstart+r->buflen==r->end) return false;
+	r->crc=crc32_update(r->buf, r->buflen, r->crc);
+	r->bufstart+=r->buflen;
+	r->buflen=r->end-r->bufstart;
+	if (r->buflen>UPS_WINDOW) r->buflen=UPS_WINDOW;
+	r->at=0;
+	if (!r->f->read(r->buf, r->bufstart, r->buflen))
+	{
+		r->ioerror=true;
+		r->buflen=0;
+		r->end=r->bufstart;
+		return false;
+	}
+	return true;
+}
+
+//The input and output, a window at the time. Everything past the input counts as zeroes, and everything
+// past the output is thrown away.
+struct ups_window {
+	file* in;
+	filewrite* out;
+	size_t inlen;
+	size_t outlen;
+	size_t len; // the longer of the two; nothing past this matters
+	
+	size_t start;
+	size_t end;
+	uint8_t * buf;
+	uint32_t crc_in;
+	uint32_t crc_out;
+};
+
+//Writes the current window, and loads the next one with the input from there.
+static enum upserror ups_window_next(struct ups_window * w)
+{
+	if (w->start<w->outlen)
+	{
+		size_t n=w->end-w->start;
+		if (n>w->outlen-w->start) n=w->outlen-w->start;
+		w->crc_out=crc32_update(w->buf, n, w->crc_out);
+		if (!w->out->append(w->buf, n)) return ups_write_failed;
+	}
+	
+	w->start=w->end;
+	w->end=w->len-w->start;
+	if (w->end>UPS_WINDOW) w->end=UPS_WINDOW;
+	w->end+=w->start;
+	
+	size_t n=(w->start<w->inlen ? w->inlen-w->start : 0);
+	if (n>w->end-w->start) n=w->end-w->start;
+	if (n)
+	{
+		if (!w->in->read(w->buf, w->start, n)) return ups_io;
+		w->crc_in=crc32_update(w->buf, n, w->crc_in);
+	}
+	memset(w->buf+n, 0, w->end-w->start-n);
+	return ups_ok;
+}
+
+enum upserror ups_apply_file(file* patch, file* in, filewrite* out)
+{
+	enum upserror error;
+	size_t patchlen=patch->len();
+	if (patchlen<4+2+12) return ups_broken;
+	
+	uint8_t trailer[12];
+	if (!patch->read(trailer, patchlen-12, 12)) return ups_io;
+	
+	struct ups_patch_reader r;
+	r.f=patch;
+	r.end=patchlen-12;
+	r.bufstart=0;
+	r.buflen=0;
+	r.at=0;
+	r.buf=(uint8_t*)malloc(UPS_WINDOW);
+	r.crc=0;
+	r.ioerror=false;
+	
+	struct ups_window w;
+	w.in=in;
+	w.out=out;
+	w.start=0;
+	w.end=0;
+	w.buf=(uint8_t*)malloc(UPS_WINDOW);
+	w.crc_in=0;
+	w.crc_out=0;
+	
+	if (!r.buf || !w.buf) error(ups_out_of_mem);
+	
+	if (true)
+	{
+#define readpatch8(var) \
+				do { \
+					if (r.at==r.buflen && !ups_patch_fill(&r)) error(r.ioerror ? ups_io : ups_broken); \
+					var=r.buf[r.at++]; \
+				} while(false)
+
+#define decodeto(var) \
+				do { \
+					var=0; \
+					unsigned int shift=0; \
+					while (true) \
+					{ \
+						uint8_t next; \
+						readpatch8(next); \
+						assert_shift(next&0x7F, shift); \
+						size_t addthis=(next&0x7F)<<shift; \
+						assert_sum(var, addthis); \
+						var+=addthis; \
+						if (next&0x80) break; \
+						shift+=7; \
+						assert_sum(var, 1U<<shift); \
+						var+=1<<shift; \
+					} \
+				} while(false)
+		
+		uint8_t magic[4];
+		for (int i=0;i<4;i++) readpatch8(magic[i]);
+		if (memcmp(magic, "UPS1", 4)) error(ups_broken);
 		
-		if (inlen==outlen)
+		//the sizes are known before anything is written, so the direction is too
+		bool backwards=false;
+		size_t inlen;
+		size_t outlen;
+		decodeto(inlen);
+		decodeto(outlen);
+		if (inlen!=in->len())
 		{
-			if ((crc_in!=crc_in_expected || crc_out!=crc_out_expected) && (crc_in!=crc_out_expected || crc_out!=crc_in_expected)) error(ups_not_this);
+			size_t tmp=inlen;
+			inlen=outlen;
+			outlen=tmp;
+			backwards=true;
 		}
-		else
+		if (inlen!=in->len()) error(ups_not_this);
+		
+		w.inlen=inlen;
+		w.outlen=outlen;
+		w.len=(inlen>outlen ? inlen : outlen);
+		error=ups_window_next(&w);
+		if (error!=ups_ok) goto exit;
+		
+		size_t pos=0;
+		while (r.at<r.buflen || ups_patch_fill(&r))
 		{
-			if (!backwards)
-			{
-				if (crc_in!=crc_in_expected) error(ups_not_this);
-				if (crc_out!=crc_out_expected) error(ups_not_this);
-			}
-			else
+			size_t skip;
+			decodeto(skip);
+			assert_sum(pos, skip);
+			pos+=skip;
+			
+			//the run may go on for several windows on both sides
+			while (true)
 			{
-				if (crc_in!=crc_out_expected) error(ups_not_this);
-				if (crc_out!=crc_in_expected) error(ups_not_this);
+				if (r.at==r.buflen && !ups_patch_fill(&r)) error(r.ioerror ? ups_io : ups_broken);
+				const uint8_t * data=r.buf+r.at;
+				const uint8_t * term=(const uint8_t*)memchr(data, 0, r.buflen-r.at);
+				size_t len=(term ? term-data : r.buflen-r.at);
+				r.at+=len;
+				assert_sum(pos, len);
+				while (len && pos<w.len)
+				{
+					while (pos>=w.end)
+					{
+						error=ups_window_next(&w);
+						if (error!=ups_ok) goto exit;
+					}
+					size_t n=w.end-pos;
+					if (n>len) n=len;
+					ups_xor(w.buf+pos-w.start, w.buf+pos-w.start, data, n);
+					data+=n;
+					len-=n;
+					pos+=n;
+				}
+				pos+=len;
+				if (term) break;
 			}
+			//the terminator stands for an unchanged byte
+			r.at++;
+			assert_sum(pos, 1);
+			pos++;
 		}
-		if (crc_patch!=crc_patch_expected) error(ups_broken);
-		return ups_ok;
-#undef read8
+		if (r.ioerror) error(ups_io);
+		while (w.end<w.len || w.start<w.end)
+		{
+			error=ups_window_next(&w);
+			if (error!=ups_ok) goto exit;
+		}
+		
+		uint32_t crc_patch=crc32_update(r.buf, r.buflen, r.crc);
+		crc_patch=crc32_update(trailer, 8, crc_patch);
+		error=ups_check_crcs(trailer, inlen==outlen, backwards, w.crc_in, w.crc_out, crc_patch);
+#undef readpatch8
 #undef decodeto
-#undef write8
 	}
-	
+
 exit:
-	free(out->ptr);
-	out->len=0;
-	out->ptr=NULL;
+	free(r.buf);
+	free(w.buf);
 	return error;
 }
+#endif
+
+//How many bytes at the start of 'ptr' are zero.
+static size_t ups_zero_len(const uint8_t * ptr, size_t len)
+{
+	static const uint8_t zeroes[4096]={0};
+	size_t i=0;
+	while (i<len)
+	{
+		size_t n=len-i;
+		if (n>sizeof(zeroes)) n=sizeof(zeroes);
+		size_t same=bytecmp_len(ptr+i, zeroes, n);
+		i+=same;
+		if (same!=n) break;
+	}
+	return i;
+}
+
+//If 'sink' is set, the patch is sent there in pieces rather than returned in patchmem. If 'sourcecrc' is
+// set, that's the checksum of the source, and it's not calculated again.
+static enum upserror ups_create_main(struct mem sourcemem, struct mem targetmem, struct mem * patchmem,
+                                     bool (*sink)(void* userdata, const uint8_t* data, size_t len), void* userdata,
+                                     const uint32_t * sourcecrc)
+{
+	if (patchmem)
+	{
+		patchmem->ptr=NULL;
+		patchmem->len=0;
+	}
+	
+	const uint8_t * source=sourcemem.ptr;
+	const uint8_t * target=targetmem.ptr;
+	size_t sourcelen=sourcemem.len;
+	size_t targetlen=targetmem.len;
+	
+	size_t outbuflen=65536;
+	uint8_t * out=(uint8_t*)malloc(outbuflen);
+	if (!out) return ups_out_of_mem;
+	size_t outlen=0;
+	size_t sentlen=0;
+	uint32_t outcrc=0;
+	bool sinkok=true;
+
+//With a sink, the buffer is sent there whenever it's full, rather than grown.
+#define makeroom() \
+			do { \
+				if (outlen==outbuflen) \
+				{ \
+					if (sink) \
+					{ \
+						outcrc=crc32_update(out, outlen, outcrc); \
+						sinkok&=sink(userdata, out, outlen); \
+						sentlen+=outlen; \
+						outlen=0; \
+					} \
+					else \
+					{ \
+						outbuflen*=2; \
+						uint8_t* newout=(uint8_t*)realloc(out, outbuflen); \
+						if (!newout) { free(out); return ups_out_of_mem; } \
+						out=newout; \
+					} \
+				} \
+			} while(0)
+#define write8(val) do { out[outlen++]=(val); makeroom(); } while(0)
+#define write32(val) \
+			do { \
+				uint32_t tmp=(val); \
+				write8(tmp); \
+				write8(tmp>>8); \
+				write8(tmp>>16); \
+				write8(tmp>>24); \
+			} while(0)
+#define writenum(val) \
+			do { \
+				size_t tmpval=(val); \
+				while (true) \
+				{ \
+					uint8_t tmpbyte=(tmpval&0x7F); \
+					tmpval>>=7; \
+					if (!tmpval) \
+					{ \
+						write8(tmpbyte|0x80); \
+						break; \
+					} \
+					write8(tmpbyte); \
+					tmpval--; \
+				} \
+			} while(0)
+//Writes source^target from 'start' to 'end'; past the end of the shorter file, that's just the longer one.
+#define writexor(start, end) \
+			do { \
+				size_t tmpat=(start); \
+				size_t tmpend=(end); \
+				while (tmpat<tmpend) \
+				{ \
+					size_t n=outbuflen-outlen; \
+					if (n>tmpend-tmpat) n=tmpend-tmpat; \
+					if (tmpat<both) \
+					{ \
+						if (n>both-tmpat) n=both-tmpat; \
+						ups_xor(out+outlen, source+tmpat, target+tmpat, n); \
+					} \
+					else memcpy(out+outlen, longer+tmpat, n); \
+					outlen+=n; \
+					tmpat+=n; \
+					makeroom(); \
+				} \
+			} while(0)
+	
+	write8('U');
+	write8('P');
+	write8('S');
+	write8('1');
+	writenum(sourcelen);
+	writenum(targetlen);
+	
+	//the shorter file counts as padded with zeroes to the length of the longer one
+	size_t len=(sourcelen>targetlen ? sourcelen : targetlen);
+	size_t both=(sourcelen<targetlen ? sourcelen : targetlen);
+	const uint8_t * longer=(sourcelen>targetlen ? source : target);
+	size_t pos=0;
+	size_t lastend=0;
+	bool anychanges=false;
+	while (true)
+	{
+		if (pos<both) pos+=bytecmp_len(source+pos, target+pos, both-pos);
+		if (pos>=both && pos<len) pos+=ups_zero_len(longer+pos, len-pos);
+		if (pos>=len) break;
+		
+		//a run of changed bytes ends at the first unchanged one, which the terminator stands for
+		size_t end=pos;
+		if (end<both) end+=bytecmp_difflen(source+end, target+end, both-end);
+		if (end>=both)
+		{
+			const uint8_t * zero=(const uint8_t*)memchr(longer+end, 0, len-end);
+			end=(zero ? zero-longer : len);
+		}
+		writenum(pos-lastend);
+		writexor(pos, end);
+		write8(0);
+		pos=end+1;
+		lastend=pos;
+		anychanges=true;
+		//if the run went to the end, the terminator is past it
+		if (pos>=len) break;
+	}
+	
+	write32(sourcecrc ? *sourcecrc : crc32(source, sourcelen));
+	write32(crc32(target, targetlen));
+	uint32_t patchcrc=crc32_update(out, outlen, outcrc);
+	write32(patchcrc);
+#undef makeroom
+#undef write8
+#undef write32
+#undef writenum
+#undef writexor
+
+	if (sink)
+	{
+		sinkok&=sink(userdata, out, outlen);
+		free(out);
+		if (!sinkok) return ups_write_failed;
+	}
+	else
+	{
+		patchmem->ptr=out;
+		patchmem->len=outlen;
+	}
+	if (!anychanges && sourcelen==targetlen) return ups_identical;
+	return ups_ok;
+}
 
 enum upserror ups_create(struct mem sourcemem, struct mem targetmem, struct mem * patchmem)
 {
-	patchmem->ptr=NULL;
-	patchmem->len=0;
-	return ups_broken;//unimplemented, just pick a random error
+	return ups_create_main(sourcemem, targetmem, patchmem, NULL, NULL, NULL);
+}
+
+#ifdef __cplusplus
+static bool ups_sink_filewrite(void* userdata, const uint8_t* data, size_t len)
+{
+	return ((filewrite*)userdata)->append(data, len);
 }
 
+enum upserror ups_create_file(struct mem sourcemem, struct mem targetmem, filewrite* patch, const uint32_t * sourcecrc)
+{
+	return ups_create_main(sourcemem, targetmem, NULL, ups_sink_filewrite, patch, sourcecrc);
+}
+#endif
+
 void ups_free(struct mem mem)
 {
 	free(mem.ptr);
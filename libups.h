@@ -16,12 +16,14 @@ enum upserror {
 	ups_unused1, //bps_to_output
 	ups_not_this,//This is not the intended input file for this patch.
 	ups_broken,  //This is not a UPS patch, or it's malformed somehow.
-	ups_unused2, //bps_io
+	ups_io,      //The patch or input couldn't be read.
 	
 	ups_identical,//The input files are identical.
 	ups_too_big,  //Somehow, you're asking for something a size_t can't represent.
-	ups_unused3,  //bps_out_of_mem
-	ups_unused4,  //bps_canceled
+	ups_out_of_mem,//Memory allocation failure.
+	ups_unused3,  //bps_canceled
+	ups_unused4,  //bps_wrong_index
+	ups_write_failed,//The patch couldn't be written to the given filewrite.
 	
 	ups_shut_up_gcc//This one isn't used, it's just to kill a stray comma warning.
 };
@@ -30,8 +32,20 @@ enum upserror {
 //  return value in out to ups_free when you're done with it.
 enum upserror ups_apply(struct mem patch, struct mem in, struct mem * out);
 
-//Creates an UPS patch that converts source to target and stores it to patch. (Not implemented.)
+#ifdef __cplusplus
+//Same as ups_apply, but the patch and input are read, and the output written, a window at the time, so
+//  it needs the same little memory for any size. The output is written before the checksums can be
+//  checked, so if this fails, throw away whatever was written.
+enum upserror ups_apply_file(file* patch, file* in, filewrite* out);
+#endif
+
+//Creates an UPS patch that converts source to target and stores it to patch.
 enum upserror ups_create(struct mem source, struct mem target, struct mem * patch);
+#ifdef __cplusplus
+//Same as ups_create, but the patch is written to 'patch' as it's created. If the checksum of the source
+//  is already known, pass it in 'sourcecrc'; otherwise, NULL.
+enum upserror ups_create_file(struct mem source, struct mem target, filewrite* patch, const uint32_t * sourcecrc);
+#endif
 
 //Frees the memory returned in the output parameters of the above. Do not call it twice on the same
 //  input, nor on anything you got from anywhere else. ups_free is guaranteed to be equivalent to
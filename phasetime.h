@@ -0,0 +1,99 @@
+//Module name: phasetime
+//Author: Alcaro
+//Date: See Git history
+//Licence: GPL v3.0 or higher
+
+//Usable from both C and C++. Only the patchers need this; their headers only need struct phase_time,
+// which is in global.h.
+
+#ifndef PHASETIME_H
+#define PHASETIME_H
+
+#include "global.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//phasetime_cpu is the CPU time of the whole process, all threads, except in a parallel region (for
+// example one of the patches --create-many makes at once), where it's only this thread's; otherwise each
+// patch would count the others too. The patchers' own parallel loops are nested in that region, so
+// unless nesting is enabled, they run on this thread and are still counted.
+static inline int phasetime_per_thread(void)
+{
+#ifdef _OPENMP
+	return omp_in_parallel();
+#else
+	return 0;
+#endif
+}
+
+#ifdef _WIN32
+#include <windows.h>
+static inline double phasetime_wall(void)
+{
+	LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / freq.QuadPart;
+}
+static inline double phasetime_cpu(void)
+{
+	FILETIME created;
+	FILETIME exited;
+	FILETIME kernel;
+	FILETIME user;
+	if (phasetime_per_thread())
+	{
+		if (!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user)) return 0;
+	}
+	else
+	{
+		if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) return 0;
+	}
+	uint64_t k = ((uint64_t)kernel.dwHighDateTime<<32) | kernel.dwLowDateTime;
+	uint64_t u = ((uint64_t)user.dwHighDateTime<<32) | user.dwLowDateTime;
+	return (double)(k+u) / 10000000; // 100ns units
+}
+#else
+#include <time.h>
+static inline double phasetime_wall(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1000000000.0;
+}
+static inline double phasetime_cpu(void)
+{
+	struct timespec ts;
+	clock_gettime(phasetime_per_thread() ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec/1000000000.0;
+}
+#endif
+
+//Start one of these, then phasetime_lap it at the end of each phase; that adds the time since the
+// last lap to the given phase. Does nothing if the phase is NULL, so callers without stats pay only
+// for a pointer check.
+struct phasetime_clock {
+	double wall;
+	double cpu;
+};
+
+static inline void phasetime_start(struct phasetime_clock * clock)
+{
+	clock->wall = phasetime_wall();
+	clock->cpu = phasetime_cpu();
+}
+
+static inline void phasetime_lap(struct phasetime_clock * clock, struct phase_time * phase)
+{
+	if (!phase) return;
+	double wall = phasetime_wall();
+	double cpu = phasetime_cpu();
+	phase->wall += wall - clock->wall;
+	phase->cpu += cpu - clock->cpu;
+	clock->wall = wall;
+	clock->cpu = cpu;
+}
+
+#endif